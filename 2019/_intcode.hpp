@@ -0,0 +1,864 @@
+#pragma once
+#include "_main.hpp"
+#include <atomic>
+
+enum class opcode : char {
+    add = 1,
+    mul = 2,
+    in = 3,
+    out = 4,
+    jnz = 5,
+    jz = 6,
+    lt = 7,
+    eq = 8,
+    crel = 9,
+    halt = 99,
+};
+
+using memory = vector<ssize_t>;
+using mem_val = memory::value_type;
+using mem_index = int;
+using io_buffer = deque<mem_val>;
+
+#include "_intcode_load.hpp"
+
+/// A contiguous run of values taken from an io_port
+struct io_span {
+    mem_val const *first, *last;
+    mem_val const *begin() const { return first; }
+    mem_val const *end() const { return last; }
+    size_t size() const { return size_t(last - first); }
+    bool empty() const { return first == last; }
+};
+
+size_t const PORT_CAPACITY = 1 << 12;
+
+/**
+ * Fixed-capacity ring buffer used for machine input and output. The storage
+ * starts empty and doubles up to the capacity as values pile up, and is
+ * reused from then on, so streaming values through a port does not
+ * allocate. A copy (e.g. of a forked machine) only holds the values still
+ * in the port.
+ */
+class io_port {
+    /// a power of two in size, at most capacity_
+    vector<mem_val> ring_;
+    size_t capacity_;
+    /// values read and written since the storage last changed
+    size_t head_ = 0, tail_ = 0;
+
+    size_t mask() const { return ring_.size() - 1; }
+    /// Moves the values into storage of n words, starting at index 0
+    void reserve(size_t n) {
+        vector<mem_val> ring(n);
+        for (size_t i = 0; i < size(); i++)
+            ring[i] = ring_[(head_ + i) & mask()];
+        tail_ = size(), head_ = 0;
+        ring_ = move(ring);
+    }
+
+  public:
+    /// capacity must be a power of two
+    explicit io_port(size_t capacity = PORT_CAPACITY) : capacity_(capacity) {}
+    io_port(io_port const &p) : capacity_(p.capacity_) { *this = p; }
+    io_port &operator=(io_port const &p) {
+        if (this == &p)
+            return *this;
+        capacity_ = p.capacity_, head_ = tail_ = 0;
+        if (ring_.size() < p.size() || ring_.size() > p.capacity_) {
+            auto n = min(size_t(16), p.capacity_);
+            while (n < p.size())
+                n *= 2;
+            ring_.assign(p.empty() ? 0 : n, 0);
+        }
+        for (size_t i = 0; i < p.size(); i++)
+            ring_[i] = p.ring_[(p.head_ + i) & p.mask()];
+        tail_ = p.size();
+        return *this;
+    }
+    io_port(io_port &&p) noexcept : capacity_(p.capacity_) {
+        *this = move(p);
+    }
+    io_port &operator=(io_port &&p) noexcept {
+        if (this == &p)
+            return *this;
+        ring_ = move(p.ring_), capacity_ = p.capacity_;
+        head_ = p.head_, tail_ = p.tail_;
+        p.ring_.clear(), p.head_ = p.tail_ = 0;
+        return *this;
+    }
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return tail_ - head_; }
+    bool empty() const { return head_ == tail_; }
+    bool full() const { return size() == capacity(); }
+    void clear() { head_ = tail_ = 0; }
+
+    mem_val front() const { return ring_[head_ & mask()]; }
+    void pop_front() { head_++; }
+    /// Appends val; false if the port is full
+    bool push_back(mem_val val) {
+        if (full())
+            return false;
+        if (size() == ring_.size())
+            reserve(min(capacity(), max(size_t(16), 2 * ring_.size())));
+        ring_[tail_++ & mask()] = val;
+        return true;
+    }
+    /// Appends as many characters of s as fit; returns how many did
+    size_t feed(string_view s) {
+        auto n = min(s.size(), capacity() - size());
+        for (size_t a = 0; a < n; a++)
+            push_back(mem_val(s[a]));
+        return n;
+    }
+    /// Appends values from [first, last) while they fit; returns the first
+    /// value that did not
+    template <class It> It feed(It first, It last) {
+        while (first != last && push_back(*first))
+            ++first;
+        return first;
+    }
+    size_t feed(io_buffer const &values) {
+        return size_t(feed(values.begin(), values.end()) - values.begin());
+    }
+    /// Moves values into the port `to` while they fit; returns how many did.
+    /// Together with machine::run() this connects two machines like a
+    /// single-producer/single-consumer channel.
+    size_t move_to(io_port &to) {
+        size_t n = 0;
+        for (; !empty() && to.push_back(front()); n++)
+            pop_front();
+        return n;
+    }
+    /// Takes the oldest contiguous run of values out of the port. The span
+    /// stays valid until the next write; call again until it is empty.
+    io_span pull() {
+        auto from = head_ & mask();
+        auto n = min(size(), ring_.size() - from);
+        head_ += n;
+        return {ring_.data() + from, ring_.data() + from + n};
+    }
+    /// Takes all values out of the port
+    io_buffer drain() {
+        io_buffer r;
+        for (auto s = pull(); !s.empty(); s = pull())
+            r.insert(r.end(), s.begin(), s.end());
+        return r;
+    }
+};
+
+enum class param_mode : char {
+    position = 0,
+    immediate = 1,
+    relative = 2,
+};
+
+/// An instruction word split into its opcode and the three parameter modes,
+/// the size of a word (see _intcode_jit.hpp).
+struct alignas(8) decoded_instr {
+    opcode op = opcode::halt;
+    array<param_mode, 3> modes = {};
+    /// the jz/jnz/crel right after it that reads the cell it writes, else
+    /// halt (see fused_follower())
+    opcode fused = opcode::halt;
+    bool valid = false;
+};
+
+/// Decodes e.g. 1002 into {mul, (position, immediate, position)} without
+/// going through a string.
+decoded_instr decode_word(mem_val p) {
+    decoded_instr d;
+    d.op = static_cast<opcode>(p % 100);
+    p /= 100;
+    for (auto &m : d.modes) {
+        m = static_cast<param_mode>(p % 10);
+        p /= 10;
+    }
+    d.valid = true;
+    return d;
+}
+
+/// How run_code dispatches instructions: through the `instr` map (the
+/// original implementation, kept for comparison), through a switch, or
+/// through natively compiled traces (see _intcode_jit.hpp)
+enum class dispatch_mode { map, jump_table, jit };
+
+#if defined(INTCODE_MAP_DISPATCH)
+dispatch_mode const DEFAULT_DISPATCH = dispatch_mode::map;
+#elif defined(INTCODE_JIT)
+dispatch_mode const DEFAULT_DISPATCH = dispatch_mode::jit;
+#else
+dispatch_mode const DEFAULT_DISPATCH = dispatch_mode::jump_table;
+#endif
+
+int const PAGE_BITS = 10;
+mem_index const PAGE_SIZE = 1 << PAGE_BITS, PAGE_MASK = PAGE_SIZE - 1;
+/// Growing the dense pages by more than this (beyond doubling) makes the
+/// new pages sparse instead
+size_t const DENSE_SLACK_PAGES = 4;
+
+/// A fused pair spans this many words after the first opcode
+size_t const FUSE_SPAN = 5;
+
+/**
+ * Words of one page plus their decode cache. The decode of a word also
+ * depends on the FUSE_SPAN words after it, so a write invalidates the
+ * decodes of up to FUSE_SPAN words before it; the guard entries let JIT
+ * traces do that without checking for the start of the page.
+ */
+struct memory_page {
+    array<mem_val, PAGE_SIZE> words = {};
+    array<decoded_instr, FUSE_SPAN> guard = {};
+    array<decoded_instr, PAGE_SIZE> decoded = {};
+};
+
+/**
+ * Superinstructions: if the add/mul/lt/eq at word k of page p is followed
+ * by a jz/jnz/crel whose first parameter is the cell it writes (cmp +
+ * branch, add + crel), the follower's opcode, else halt. Pairs crossing a
+ * page are not fused, so writes only invalidate decodes of their own page.
+ */
+opcode fused_follower(memory_page const &p, size_t k, decoded_instr d) {
+    if ((d.op != opcode::add && d.op != opcode::mul && d.op != opcode::lt &&
+         d.op != opcode::eq) ||
+        k + FUSE_SPAN >= size_t(PAGE_SIZE))
+        return opcode::halt;
+    auto next = decode_word(p.words[k + 4]);
+    if ((next.op != opcode::jz && next.op != opcode::jnz &&
+         next.op != opcode::crel) ||
+        d.modes[2] == param_mode::immediate || next.modes[0] != d.modes[2] ||
+        p.words[k + 3] != p.words[k + 5])
+        return opcode::halt;
+    return next.op;
+}
+
+/**
+ * Machine memory split into pages. The program image and everything near it
+ * lives in dense pages that are always allocated; pages far beyond them are
+ * sparse and only allocated on the first write (unwritten memory reads as 0),
+ * so a single write to a huge address costs one page.
+ *
+ * Copies share the page table and the pages until one side writes
+ * (copy-on-write), so copying a memory costs O(1) and only written pages are
+ * ever duplicated.
+ */
+class paged_memory {
+    struct page_table {
+        vector<shared_ptr<memory_page>> dense;
+        map<size_t, shared_ptr<memory_page>> sparse;
+    };
+    shared_ptr<page_table> table_ = make_shared<page_table>();
+    size_t size_ = 0;
+    /// bumped whenever a dense page pointer in the table changes
+    size_t layout_ = 0;
+    /// true while neither the table nor any page is shared (see exclusive());
+    /// atomic since forking a const machine on several threads clears it
+    mutable atomic<bool> exclusive_ = true;
+
+    page_table &own_table() {
+        if (table_.use_count() > 1) {
+            table_ = make_shared<page_table>(*table_);
+            layout_++;
+        }
+        return *table_;
+    }
+    shared_ptr<memory_page> &own_page(mem_index i) {
+        auto &t = own_table();
+        auto i_page = size_t(i) >> PAGE_BITS;
+        auto &p = i_page < t.dense.size() ? t.dense[i_page] : t.sparse[i_page];
+        if (!p)
+            p = make_shared<memory_page>();
+        else if (p.use_count() > 1) {
+            p = make_shared<memory_page>(*p);
+            layout_++;
+        }
+        return p;
+    }
+    /// The table slot of the page holding i, null if it was never written
+    shared_ptr<memory_page> const *find_page(mem_index i) const {
+        auto i_page = size_t(i) >> PAGE_BITS;
+        if (i_page < table_->dense.size())
+            return &table_->dense[i_page];
+        auto p = table_->sparse.find(i_page);
+        return p == table_->sparse.end() ? nullptr : &p->second;
+    }
+
+    void grow_dense(size_t n_pages) {
+        if (n_pages <= table_->dense.size())
+            return;
+        auto &t = own_table();
+        while (t.dense.size() < n_pages) {
+            auto p = t.sparse.find(t.dense.size());
+            if (p != t.sparse.end()) {
+                t.dense.push_back(move(p->second));
+                t.sparse.erase(p);
+            } else
+                t.dense.push_back(make_shared<memory_page>());
+        }
+        layout_++;
+    }
+
+    static void write_word(memory_page &p, size_t k, mem_val val) {
+        p.words[k] = val;
+        // the word itself and the first words of the pairs it belongs to
+        for (auto j : {size_t(0), size_t(3), size_t(4), FUSE_SPAN})
+            if (k >= j)
+                p.decoded[k - j].valid = false;
+    }
+
+  public:
+    paged_memory(memory const &image) : size_(image.size()) {
+        grow_dense((image.size() + PAGE_SIZE - 1) >> PAGE_BITS);
+        for (size_t i = 0; i < image.size(); i += PAGE_SIZE)
+            copy_n(image.begin() + ptrdiff_t(i),
+                   min(size_t(PAGE_SIZE), image.size() - i),
+                   table_->dense[i >> PAGE_BITS]->words.begin());
+    }
+    paged_memory(paged_memory const &p)
+        : table_(p.table_), size_(p.size_), exclusive_(false) {
+        p.exclusive_.store(false, memory_order_relaxed);
+    }
+    paged_memory &operator=(paged_memory const &p) {
+        table_ = p.table_, size_ = p.size_, layout_++;
+        exclusive_.store(false, memory_order_relaxed);
+        p.exclusive_.store(false, memory_order_relaxed);
+        return *this;
+    }
+
+    size_t size() const { return size_; }
+    size_t layout() const { return layout_; }
+    /// Grows the memory to n words (new words are 0). Pages close to the
+    /// dense ones become dense, anything further away stays sparse.
+    void resize(size_t n) {
+        if (n <= size_)
+            return;
+        size_ = n;
+        auto n_pages = (n + PAGE_SIZE - 1) >> PAGE_BITS;
+        if (n_pages <= 2 * table_->dense.size() + DENSE_SLACK_PAGES)
+            grow_dense(n_pages);
+    }
+
+    mem_val operator[](mem_index i) const {
+        auto i_page = size_t(i) >> PAGE_BITS;
+        if (i_page < table_->dense.size())
+            return table_->dense[i_page]->words[i & PAGE_MASK];
+        auto p = find_page(i);
+        return p ? (*p)->words[i & PAGE_MASK] : 0;
+    }
+    void write(mem_index i, mem_val val) {
+        write_word(*own_page(i), size_t(i & PAGE_MASK), val);
+    }
+    /// Decodes the word at i; the result is cached unless the page is shared
+    decoded_instr decode(mem_index i) {
+        auto p = find_page(i);
+        if (!p)
+            return decode_word(0);
+        auto k = size_t(i & PAGE_MASK);
+        auto &d = (*p)->decoded[k];
+        if (d.valid)
+            return d;
+        auto r = decode_word((*p)->words[k]);
+        r.fused = fused_follower(**p, k, r);
+        if (exclusive() || (table_.use_count() == 1 && p->use_count() == 1))
+            d = r;
+        return r;
+    }
+
+    /// Unshares the table and all pages so they can be written in place
+    void make_exclusive() {
+        if (exclusive())
+            return;
+        auto &t = own_table();
+        for (auto i : nums(0_s, t.dense.size()))
+            own_page(mem_index(i << PAGE_BITS));
+        for (auto &[i_page, p] : t.sparse)
+            own_page(mem_index(i_page << PAGE_BITS));
+        exclusive_.store(true, memory_order_relaxed);
+    }
+    bool exclusive() const { return exclusive_.load(memory_order_relaxed); }
+    /**
+     * Makes the contents equal to src by writing the words that differ into
+     * our own pages, so their decode cache survives for the words that did
+     * not change. Costs O(size) rather than the O(1) of operator=, and falls
+     * back to it when the page layouts differ.
+     */
+    void copy_words(paged_memory const &src) {
+        if (src.n_pages() != n_pages() || !src.table_->sparse.empty() ||
+            !table_->sparse.empty()) {
+            *this = src;
+            return;
+        }
+        make_exclusive();
+        size_ = src.size_;
+        for (size_t i_page = 0; i_page < n_pages(); i_page++) {
+            auto &to = *page(i_page);
+            auto &from = *src.page(i_page);
+            for (size_t k = 0; k < PAGE_SIZE; k++)
+                if (to.words[k] != from.words[k])
+                    write_word(to, k, from.words[k]);
+        }
+    }
+    /// Dense pages, which are never null
+    memory_page *page(size_t i_page) const {
+        return table_->dense[i_page].get();
+    }
+    size_t n_pages() const { return table_->dense.size(); }
+    /// Size of the memory covered by dense pages
+    size_t dense_size() const {
+        return min(size_, n_pages() << PAGE_BITS);
+    }
+};
+
+class jit_cache;
+/// Owns the JIT state of a machine; copies of a machine start without one
+struct jit_handle {
+    unique_ptr<jit_cache> p;
+    jit_handle() = default;
+    jit_handle(jit_handle const &) {}
+    jit_handle(jit_handle &&) = default;
+    jit_handle &operator=(jit_handle const &) { return *this = jit_handle(); }
+    jit_handle &operator=(jit_handle &&);
+    ~jit_handle();
+};
+
+#include "_intcode_profile.hpp"
+
+#ifdef INTCODE_PROFILE
+bool const PROFILE = true;
+#else
+bool const PROFILE = false;
+#endif
+
+/// Why machine::run() returned
+enum class stop_reason { halted, input, output, fault };
+
+/// What an ASCII program printed, see machine::run_ascii()
+struct ascii_output {
+    string text;
+    /// the last value that is not a character, usually the answer
+    optional<mem_val> value;
+    void clear() { text.clear(), value.reset(); }
+};
+
+class machine;
+/// State of a machine at some point, see machine::snapshot()
+struct machine_snapshot {
+    paged_memory mem;
+    mem_index i_mem, relative_offset_;
+    io_port input_;
+    bool halted_;
+};
+
+class machine {
+    jit_handle jit_;
+
+    mem_index address(decoded_instr d, int j);
+    void run_fused(opcode follower, mem_val val);
+    bool step();
+    void run_map();
+    void run_jump_table();
+    void run_jit();
+    void jit_on_write(mem_index i);
+    void restore_registers(machine_snapshot const &s);
+
+  public:
+    paged_memory mem;
+    mem_index i_mem = 0;
+    io_port input_, output_;
+    int status_ = 0;
+    bool halted_ = false;
+    mem_index relative_offset_ = 0;
+    dispatch_mode dispatch_ = DEFAULT_DISPATCH;
+    /// Execution counters, only with PROFILE (shared with forks, see
+    /// fork_detached())
+    shared_ptr<machine_profile> profile_;
+
+    machine(memory const &p_mem) : mem(p_mem) {
+        if (PROFILE)
+            profile_ = make_shared<machine_profile>();
+    }
+    machine(machine_snapshot const &s) : mem(s.mem) {
+        restore(s);
+        if (PROFILE)
+            profile_ = make_shared<machine_profile>();
+    }
+    virtual stop_reason run();
+    io_buffer run_code(io_buffer input);
+    /// Queues a line of ASCII input, adding the newline
+    void send_line(string_view line);
+    stop_reason run_ascii(ascii_output &out, size_t max_text = SIZE_MAX);
+
+    /// Reads memory, growing it if needed (unknown memory is 0)
+    mem_val read(mem_index i) {
+        if (size_t(i) >= mem.size())
+            grow(i);
+        return mem[i];
+    }
+    void write(mem_index i, mem_val val) {
+        if (size_t(i) >= mem.size())
+            grow(i);
+        mem.write(i, val);
+        if (jit_.p)
+            jit_on_write(i);
+    }
+    void grow(mem_index i) {
+        if (i < 0)
+            throw out_of_range("negative address " + to_string(i));
+        mem.resize(size_t(i) + 1);
+    }
+
+    /// Captures the current state in O(1) plus the queued input; memory is
+    /// shared copy-on-write
+    machine_snapshot snapshot() const {
+        return {mem, i_mem, relative_offset_, input_, halted_};
+    }
+    void restore(machine_snapshot const &s) {
+        mem = s.mem;
+        restore_registers(s);
+    }
+    /// Like restore(), but copies back only the words that differ into this
+    /// machine's own pages, keeping their decoded instructions; O(memory
+    /// size), for a machine rewound to the same snapshot over and over
+    void rewind(machine_snapshot const &s) {
+        mem.copy_words(s.mem);
+        restore_registers(s);
+    }
+    /// An independent machine continuing from the current state
+    machine fork() const { return *this; }
+    /// A fork to run on another thread: it counts into a profile of its
+    /// own, to be added back with join_profile() after the threads joined
+    machine fork_detached() const {
+        auto m = fork();
+        if (m.profile_)
+            m.profile_ = make_shared<machine_profile>(false);
+        return m;
+    }
+    /// Merges the profile of a fork_detached() machine into ours, which the
+    /// fork then shares again
+    void join_profile(machine &fork) const {
+        if (profile_ && fork.profile_ && fork.profile_ != profile_) {
+            profile_->merge(*fork.profile_);
+            fork.profile_ = profile_;
+        }
+    }
+};
+
+class memory_cell {
+    machine &m_;
+    decoded_instr const d_;
+
+  public:
+    memory_cell(machine &m, decoded_instr d, mem_index base)
+        : m_(m), d_(d), base_(base) {}
+
+    mem_index const base_;
+
+    /// Resolves the address of parameter j according to its mode
+    mem_index address(int j) const {
+        switch (d_.modes[j]) {
+        case param_mode::position:
+            return mem_index(m_.read(base_ + j));
+        case param_mode::immediate:
+            return base_ + j;
+        case param_mode::relative:
+            return mem_index(m_.relative_offset_ + m_.read(base_ + j));
+        default:
+            cerr << "unknown mode " << int(d_.modes[j]) << " in cell "
+                 << base_ << "\n";
+            throw "unknown parameter mode";
+        }
+    }
+
+    mem_val operator[](int j) const { return m_.read(address(j)); }
+    void set(int j, mem_val val) const { m_.write(address(j), val); }
+};
+
+class instruction {
+  public:
+    using func = function<mem_index(memory_cell, machine &)>;
+    instruction(func p_action) : action(move(p_action)) {}
+    auto operator()(memory_cell c, machine &m) const {
+        return action(move(c), m);
+    }
+
+  private:
+    func action;
+};
+
+/// instruction map
+const map<opcode, instruction> instr = {
+    {opcode::add, {[](auto c, auto &m) {
+         c.set(2, c[0] + c[1]);
+         return 4;
+     }}},
+    {opcode::mul, {[](auto c, auto &m) {
+         c.set(2, c[0] * c[1]);
+         return 4;
+     }}},
+    {opcode::in, {[](auto c, auto &m) {
+         if (!m.input_.empty()) {
+             c.set(0, m.input_.front());
+             m.input_.pop_front();
+         } else {
+             // cout << "Awaiting input\n";
+             m.status_ = 2;
+             return 0;
+         }
+         return 2;
+     }}},
+    {opcode::out, {[](auto c, auto &m) {
+         if (!m.output_.push_back(c[0])) {
+             m.status_ = 2;
+             return 0;
+         }
+         return 2;
+     }}},
+    {opcode::jnz, {[](auto c, auto &m) {
+         if (m.profile_)
+             m.profile_->jump(c.base_ - 1, c[0] != 0);
+         if (c[0] != 0)
+             return static_cast<mem_index>(-c.base_ + c[1] + 1);
+         else
+             return static_cast<mem_index>(3);
+     }}},
+    {opcode::jz, {[](auto c, auto &m) {
+         if (m.profile_)
+             m.profile_->jump(c.base_ - 1, c[0] == 0);
+         if (c[0] == 0)
+             return static_cast<mem_index>(-c.base_ + c[1] + 1);
+         else
+             return static_cast<mem_index>(3);
+     }}},
+    {opcode::lt, {[](auto c, auto &m) {
+         c.set(2, c[0] < c[1]);
+         return 4;
+     }}},
+    {opcode::eq, {[](auto c, auto &m) {
+         c.set(2, c[0] == c[1]);
+         return 4;
+     }}},
+    {opcode::crel, {[](auto c, auto &m) {
+         m.relative_offset_ += c[0];
+         return 2;
+     }}},
+};
+
+/**
+ * Runs on the ports in place until the program halts, blocks on empty input
+ * or fills the output port. JIT traces cannot be counted, so a profiled
+ * machine always runs on the switch interpreter.
+ */
+stop_reason machine::run() {
+    auto start = chrono::steady_clock::now();
+    if (dispatch_ == dispatch_mode::map)
+        run_map();
+    else if (dispatch_ == dispatch_mode::jit && !profile_)
+        run_jit();
+    else
+        run_jump_table();
+    if (profile_)
+        profile_->slice(chrono::steady_clock::now() - start);
+    if (halted_)
+        return stop_reason::halted;
+    if (size_t(i_mem) < mem.size()) {
+        auto op = mem.decode(i_mem).op;
+        if (op == opcode::in && input_.empty())
+            return stop_reason::input;
+        if (op == opcode::out && output_.full())
+            return stop_reason::output;
+    }
+    return stop_reason::fault;
+}
+
+/**
+ * Runs until the program halts or blocks on empty input.
+ * @return the values output during this run
+ */
+io_buffer machine::run_code(io_buffer input) {
+    input_.clear(), output_.clear();
+    io_buffer out;
+    for (auto fed = input.begin();;) {
+        fed = input_.feed(fed, input.end());
+        auto why = run();
+        for (auto s = output_.pull(); !s.empty(); s = output_.pull())
+            out.insert(out.end(), s.begin(), s.end());
+        if (why != stop_reason::output &&
+            (why != stop_reason::input || fed == input.end()))
+            return out;
+    }
+}
+
+void machine::restore_registers(machine_snapshot const &s) {
+    i_mem = s.i_mem, relative_offset_ = s.relative_offset_;
+    input_ = s.input_, halted_ = s.halted_;
+    output_.clear(), status_ = 0;
+    jit_ = {};
+}
+
+void machine::send_line(string_view line) {
+    if (input_.size() + line.size() + 1 > input_.capacity()) {
+        cerr << "input line of " << line.size() << " characters does not fit\n";
+        throw "input line too long";
+    }
+    input_.feed(line);
+    input_.push_back('\n');
+}
+
+/**
+ * Runs until the program halts or blocks on empty input, appending its
+ * output to out.text (a full output port does not stop it). Values outside
+ * the ASCII range go to out.value instead.
+ * @return stop_reason::output if out.text grew beyond max_text, e.g. since
+ * the program prints forever
+ */
+stop_reason machine::run_ascii(ascii_output &out, size_t max_text) {
+    for (;;) {
+        auto why = run();
+        for (auto s = output_.pull(); !s.empty(); s = output_.pull())
+            for (auto a : s)
+                if (a >= 0 && a < 128)
+                    out.text += char(a);
+                else
+                    out.value = a;
+        if (why != stop_reason::output || out.text.size() > max_text)
+            return why;
+    }
+}
+
+void machine::run_map() {
+    while (size_t(i_mem) < mem.size()) {
+        auto d = mem.decode(i_mem);
+        // cout << "instruction " << mem[i_mem] << " = " << int(d.op) << "\n";
+        if (profile_)
+            profile_->count(i_mem, d.op);
+        if (d.op == opcode::halt) {
+            halted_ = true;
+            break;
+        }
+        if (auto a = instr.find(d.op); a != instr.end())
+            i_mem += a->second(memory_cell(*this, d, i_mem + 1), *this);
+        else {
+            cerr << i_mem << ": unknown opcode " << int(d.op) << "\n";
+            break;
+        }
+        if (status_ != 0) {
+            status_ = 0;
+            break;
+        }
+    }
+}
+
+/// Address parameter j of the instruction d at i_mem refers to
+mem_index machine::address(decoded_instr d, int j) {
+    auto p = read(i_mem + 1 + j);
+    switch (d.modes[j]) {
+    case param_mode::position:
+        return mem_index(p);
+    case param_mode::immediate:
+        return i_mem + 1 + j;
+    case param_mode::relative:
+        return mem_index(relative_offset_ + p);
+    }
+    cerr << "unknown mode " << int(d.modes[j]) << " in cell " << i_mem + 1
+         << "\n";
+    throw "unknown parameter mode";
+}
+
+/**
+ * Runs the follower of a fused pair (see fused_follower()) at i_mem right
+ * away on val, the value its first parameter reads, without another
+ * dispatch. A jump into the middle of a pair simply runs the second half on
+ * its own.
+ */
+void machine::run_fused(opcode follower, mem_val val) {
+    if (profile_)
+        profile_->count(i_mem, follower);
+    if (follower == opcode::crel) {
+        relative_offset_ += val;
+        i_mem += 2;
+        return;
+    }
+    auto taken = (val != 0) == (follower == opcode::jnz);
+    if (profile_)
+        profile_->jump(i_mem, taken);
+    i_mem = taken ? mem_index(read(address(mem.decode(i_mem), 1))) : i_mem + 3;
+}
+
+/**
+ * Executes the instruction at i_mem. Same semantics as one run_map
+ * iteration, but with the operand fetch inlined and a switch (compiled to a
+ * jump table) instead of map lookup + std::function.
+ * @return false if the machine halted, blocks on input or the output port
+ * is full
+ */
+bool machine::step() {
+    auto d = mem.decode(i_mem);
+    auto addr = [&](int j) { return address(d, j); };
+    auto arg = [&](int j) { return read(addr(j)); };
+    // stores the result of a three-parameter instruction and runs a fused
+    // follower, if any
+    auto result = [&](mem_val val) {
+        auto dst = addr(2);
+        write(dst, val);
+        i_mem += 4;
+        // unless the write changed the follower itself
+        if (d.fused != opcode::halt && dst != i_mem && dst != i_mem + 1)
+            run_fused(d.fused, val);
+    };
+    // cout << "instruction " << mem[i_mem] << " = " << int(d.op) << "\n";
+    if (profile_)
+        profile_->count(i_mem, d.op);
+    switch (d.op) {
+    case opcode::add:
+        result(arg(0) + arg(1));
+        break;
+    case opcode::mul:
+        result(arg(0) * arg(1));
+        break;
+    case opcode::in:
+        if (input_.empty())
+            return false;
+        write(addr(0), input_.front());
+        input_.pop_front();
+        i_mem += 2;
+        break;
+    case opcode::out:
+        if (!output_.push_back(arg(0)))
+            return false;
+        i_mem += 2;
+        break;
+    case opcode::jnz:
+    case opcode::jz: {
+        auto taken = (arg(0) != 0) == (d.op == opcode::jnz);
+        if (profile_)
+            profile_->jump(i_mem, taken);
+        i_mem = taken ? mem_index(arg(1)) : i_mem + 3;
+        break;
+    }
+    case opcode::lt:
+        result(arg(0) < arg(1));
+        break;
+    case opcode::eq:
+        result(arg(0) == arg(1));
+        break;
+    case opcode::crel:
+        relative_offset_ += arg(0);
+        i_mem += 2;
+        break;
+    case opcode::halt:
+        halted_ = true;
+        return false;
+    default:
+        cerr << i_mem << ": unknown opcode " << int(d.op) << "\n";
+        return false;
+    }
+    return true;
+}
+
+void machine::run_jump_table() {
+    while (size_t(i_mem) < mem.size() && step())
+        ;
+}
+
+#include "_intcode_jit.hpp"
@@ -0,0 +1,53 @@
+#pragma once
+#include "_intcode.hpp"
+
+/**
+ * Runtime for programs translated to C++ by stuff/intcode_aot.
+ *
+ * The generated function runs the program with one label per reachable
+ * instruction and returns when the program halts, blocks on input or fills
+ * the output port. If it jumps to an address that is not a known
+ * instruction, or writes to a word that was compiled as code, it calls
+ * fall_back() and the rest of the program runs on the embedded interpreter.
+ */
+class aot_machine : public machine {
+  public:
+    using compiled_fn = void (*)(aot_machine &);
+
+    aot_machine(memory p_mem, memory const &image,
+                vector<mem_index> const &code_words, compiled_fn compiled)
+        : machine(move(p_mem)), compiled_(compiled) {
+        is_code_.resize(image.size());
+        for (auto i : code_words) {
+            is_code_[i] = true;
+            // the compiled code assumes the original instruction words
+            if (size_t(i) >= mem.size() || mem[i] != image[i])
+                fallback_ = true;
+        }
+    }
+
+    stop_reason run() override {
+        if (!fallback_) {
+            compiled_(*this);
+            if (halted_)
+                return stop_reason::halted;
+            if (!fallback_)
+                return output_.full() ? stop_reason::output
+                                      : stop_reason::input;
+        }
+        return machine::run();
+    }
+
+    /// Writes val to i; true if the write modified compiled code
+    bool store(mem_index i, mem_val val) {
+        write(i, val);
+        return size_t(i) < is_code_.size() && is_code_[i];
+    }
+    void fall_back() { fallback_ = true; }
+    bool interpreted() const { return fallback_; }
+
+  private:
+    vector<bool> is_code_;
+    bool fallback_ = false;
+    compiled_fn compiled_;
+};
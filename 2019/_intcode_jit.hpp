@@ -0,0 +1,465 @@
+#pragma once
+/**
+ * Optional x86-64 JIT for the shared Intcode machine (dispatch_mode::jit).
+ *
+ * Hot entry points are compiled into straight-line traces: the trace starts at
+ * the entry pc and follows the instruction stream in address order, so loops
+ * whose back edge jumps to an earlier instruction of the same trace stay in
+ * native code. in/out/halt end a trace and are handled by machine::step().
+ *
+ * Compiled code bails out to the interpreter (before any side effect of the
+ * offending instruction) when an address is outside the allocated memory or
+ * when a write would hit a compiled word. The interpreter then executes the
+ * instruction, growing memory or invalidating the affected traces.
+ */
+#include "_intcode.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Everything a trace needs, passed in rdi
+struct jit_state {
+    memory_page *const *pages;
+    int64_t size;
+    int64_t rel;
+    uint8_t const *code_map;
+    int64_t pc;
+    int64_t bailed;
+};
+
+static_assert(sizeof(decoded_instr) == 8, "traces index decoded with *8");
+static_assert(offsetof(memory_page, words) == 0 &&
+                  offsetof(memory_page, decoded) ==
+                      (PAGE_SIZE + FUSE_SPAN) * 8,
+              "traces address words and decode cache from the page base");
+
+class x64_emitter {
+  public:
+    vector<uint8_t> code;
+
+    void bytes(initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+    void imm32(int64_t v) {
+        for (auto a : nums(0, 4))
+            code.push_back(uint8_t(uint64_t(v) >> (8 * a)));
+    }
+    void imm64(int64_t v) {
+        for (auto a : nums(0, 8))
+            code.push_back(uint8_t(uint64_t(v) >> (8 * a)));
+    }
+    /// Emits jcc/jmp rel32 and returns the position of the displacement
+    size_t jump(initializer_list<uint8_t> op) {
+        bytes(op);
+        auto at = code.size();
+        imm32(0);
+        return at;
+    }
+    void patch(size_t at, size_t target) {
+        auto rel = int64_t(target) - int64_t(at + 4);
+        for (auto a : nums(0, 4))
+            code[at + a] = uint8_t(uint64_t(rel) >> (8 * a));
+    }
+};
+
+/// A compiled trace covering the words [from, to)
+struct jit_trace {
+    mem_index from, to;
+    void *page = nullptr;
+    size_t page_size = 0;
+    void (*fn)(jit_state *) = nullptr;
+};
+
+class jit_cache {
+    /// Registers: rdi = state, r8 = dense page table, r9 = dense memory size,
+    /// r10 = relative base, r11 = code map; rax/rcx/rdx/rsi are scratch.
+    /// Anything outside the dense pages bails to the interpreter.
+    enum reg : uint8_t { RAX = 0, RCX = 1, RDX = 2 };
+    static int const HOT_THRESHOLD = 8, MAX_TRACE = 256;
+    static int64_t const MAX_DIRECT_ADDRESS = 1 << 27;
+    enum : int32_t { NONE = -1, UNCOMPILABLE = -2 };
+
+    vector<jit_trace> traces_;
+    /// slots of invalidated traces, reused by the next compiles
+    vector<int32_t> free_;
+    vector<int32_t> trace_at_; /// pc -> index into traces_
+    vector<uint16_t> heat_;
+
+    struct trace_instr {
+        mem_index pc;
+        decoded_instr d;
+        array<mem_val, 3> p;
+    };
+    optional<jit_trace> compile(machine &m, mem_index entry);
+    void release(jit_trace &t) {
+        if (t.page)
+            munmap(t.page, t.page_size);
+        t.page = nullptr, t.fn = nullptr;
+    }
+
+  public:
+    vector<uint8_t> code_map; /// 1 for words covered by a trace
+    vector<memory_page *> pages;
+    size_t layout = size_t(-1); /// paged_memory::layout() of `pages`
+    jit_state state;
+    size_t n_compiled = 0, n_invalidated = 0;
+
+    jit_cache() = default;
+    jit_cache(jit_cache const &) = delete;
+    ~jit_cache() {
+        for (auto &t : traces_)
+            release(t);
+    }
+
+    /// Returns the trace starting at pc, compiling it once pc is hot
+    jit_trace const *trace_at(machine &m, mem_index pc);
+    /// Drops every trace that covers address i
+    void invalidate(mem_index i);
+};
+
+jit_handle::~jit_handle() = default;
+jit_handle &jit_handle::operator=(jit_handle &&) = default;
+
+optional<jit_trace> jit_cache::compile(machine &m, mem_index entry) {
+    // collect the instructions of the trace
+    vector<trace_instr> instrs;
+    auto pc = entry;
+    auto size = mem_index(m.mem.dense_size());
+    auto const &mem = m.mem;
+    auto fits = [](mem_val v) {
+        return v > -MAX_DIRECT_ADDRESS && v < MAX_DIRECT_ADDRESS;
+    };
+    while (pc < size && int(instrs.size()) < MAX_TRACE) {
+        auto d = decode_word(mem[pc]);
+        int n_params;
+        switch (d.op) {
+        case opcode::add:
+        case opcode::mul:
+        case opcode::lt:
+        case opcode::eq:
+            n_params = 3;
+            break;
+        case opcode::jnz:
+        case opcode::jz:
+            n_params = 2;
+            break;
+        case opcode::crel:
+            n_params = 1;
+            break;
+        default:
+            n_params = -1;
+        }
+        if (n_params < 0 || pc + n_params >= size)
+            break;
+        trace_instr t = {pc, d, {}};
+        auto ok = true;
+        for (auto j : nums(0, n_params)) {
+            t.p[j] = mem[pc + 1 + j];
+            if (int(d.modes[j]) > 2 || !fits(t.p[j]) ||
+                (d.modes[j] == param_mode::position && t.p[j] < 0))
+                ok = false;
+        }
+        if (n_params == 3 && d.modes[2] == param_mode::immediate)
+            ok = false;
+        if (!ok)
+            break;
+        instrs.push_back(t);
+        pc += 1 + n_params;
+        // an unconditional jump ends the trace
+        if ((d.op == opcode::jnz || d.op == opcode::jz) &&
+            d.modes[0] == param_mode::immediate &&
+            ((t.p[0] != 0) == (d.op == opcode::jnz)))
+            break;
+    }
+    if (instrs.empty())
+        return {};
+
+    x64_emitter e;
+    auto const OFF_PAGES = uint8_t(offsetof(jit_state, pages)),
+               OFF_SIZE = uint8_t(offsetof(jit_state, size)),
+               OFF_REL = uint8_t(offsetof(jit_state, rel)),
+               OFF_MAP = uint8_t(offsetof(jit_state, code_map)),
+               OFF_PC = uint8_t(offsetof(jit_state, pc)),
+               OFF_BAILED = uint8_t(offsetof(jit_state, bailed));
+    auto const OFF_VALID = int64_t(offsetof(memory_page, decoded) +
+                                   offsetof(decoded_instr, valid));
+
+    e.bytes({0x4C, 0x8B, 0x47, OFF_PAGES}); // mov r8, [rdi+pages]
+    e.bytes({0x4C, 0x8B, 0x4F, OFF_SIZE});  // mov r9, [rdi+size]
+    e.bytes({0x4C, 0x8B, 0x57, OFF_REL});   // mov r10, [rdi+rel]
+    e.bytes({0x4C, 0x8B, 0x5F, OFF_MAP});   // mov r11, [rdi+code_map]
+
+    map<mem_index, size_t> labels;
+    vector<pair<size_t, mem_index>> exits;        // jump -> leave with pc
+    vector<pair<size_t, mem_index>> bails;        // jump -> bail at pc
+    vector<size_t> to_epilogue;
+
+    auto bounds_check_rcx = [&](mem_index at) {
+        e.bytes({0x4C, 0x39, 0xC9}); // cmp rcx, r9
+        bails.push_back({e.jump({0x0F, 0x83}), at}); // jae bail
+    };
+    // rsi = page of address rcx, rcx = offset in that page
+    auto page_of_rcx = [&](mem_index at) {
+        e.bytes({0x48, 0x89, 0xCE});             // mov rsi, rcx
+        e.bytes({0x48, 0xC1, 0xEE, PAGE_BITS});  // shr rsi, PAGE_BITS
+        e.bytes({0x49, 0x8B, 0x34, 0xF0});       // mov rsi, [r8+rsi*8]
+        e.bytes({0x48, 0x85, 0xF6});             // test rsi, rsi
+        bails.push_back({e.jump({0x0F, 0x84}), at}); // jz bail
+        e.bytes({0x81, 0xE1});                   // and ecx, PAGE_MASK
+        e.imm32(PAGE_MASK);
+    };
+    // loads the value of parameter j into register r
+    auto load = [&](trace_instr const &t, int j, reg r) {
+        switch (t.d.modes[j]) {
+        case param_mode::immediate:
+            e.bytes({0x48, uint8_t(0xB8 + r)}); // mov r, imm64
+            e.imm64(t.p[j]);
+            break;
+        case param_mode::position:
+            e.bytes({0x49, 0x81, 0xF9}); // cmp r9, imm32
+            e.imm32(t.p[j]);
+            bails.push_back({e.jump({0x0F, 0x8E}), t.pc}); // jle bail
+            e.bytes({0x49, 0x8B, 0xB0}); // mov rsi, [r8+disp]
+            e.imm32((t.p[j] >> PAGE_BITS) * 8);
+            e.bytes({0x48, 0x85, 0xF6}); // test rsi, rsi
+            bails.push_back({e.jump({0x0F, 0x84}), t.pc}); // jz bail
+            e.bytes({0x48, 0x8B, uint8_t(0x86 | r << 3)}); // mov r, [rsi+disp]
+            e.imm32((t.p[j] & PAGE_MASK) * 8);
+            break;
+        case param_mode::relative:
+            e.bytes({0x49, 0x8D, 0x8A}); // lea rcx, [r10+disp]
+            e.imm32(t.p[j]);
+            bounds_check_rcx(t.pc);
+            page_of_rcx(t.pc);
+            e.bytes({0x48, 0x8B, uint8_t(r << 3 | 4), 0xCE}); // mov r, [rsi+rcx*8]
+            break;
+        }
+    };
+    // writes rax to the destination parameter j
+    auto store = [&](trace_instr const &t, int j) {
+        if (t.d.modes[j] == param_mode::position) {
+            e.bytes({0x48, 0xC7, 0xC1}); // mov rcx, imm32
+            e.imm32(t.p[j]);
+        } else {
+            e.bytes({0x49, 0x8D, 0x8A}); // lea rcx, [r10+disp]
+            e.imm32(t.p[j]);
+        }
+        bounds_check_rcx(t.pc);
+        e.bytes({0x41, 0x80, 0x3C, 0x0B, 0x00}); // cmp byte [r11+rcx], 0
+        bails.push_back({e.jump({0x0F, 0x85}), t.pc}); // jne bail
+        page_of_rcx(t.pc);
+        e.bytes({0x48, 0x89, 0x04, 0xCE}); // mov [rsi+rcx*8], rax
+        // decoded[rcx - j].valid = false, as in paged_memory::write(); the
+        // page's guard entries catch rcx < j
+        for (int64_t j : {0, 3, 4, int(FUSE_SPAN)}) {
+            e.bytes({0xC6, 0x84, 0xCE}); // mov byte [rsi+rcx*8+disp], 0
+            e.imm32(OFF_VALID - 8 * j);
+            e.bytes({0x00});
+        }
+    };
+
+    for (auto &t : instrs) {
+        labels[t.pc] = e.code.size();
+        switch (t.d.op) {
+        case opcode::add:
+        case opcode::mul:
+        case opcode::lt:
+        case opcode::eq:
+            load(t, 0, RAX);
+            load(t, 1, RDX);
+            if (t.d.op == opcode::add)
+                e.bytes({0x48, 0x01, 0xD0}); // add rax, rdx
+            else if (t.d.op == opcode::mul)
+                e.bytes({0x48, 0x0F, 0xAF, 0xC2}); // imul rax, rdx
+            else {
+                e.bytes({0x48, 0x39, 0xD0}); // cmp rax, rdx
+                if (t.d.op == opcode::lt)
+                    e.bytes({0x0F, 0x9C, 0xC0}); // setl al
+                else
+                    e.bytes({0x0F, 0x94, 0xC0}); // sete al
+                e.bytes({0x0F, 0xB6, 0xC0});     // movzx eax, al
+            }
+            store(t, 2);
+            break;
+        case opcode::crel:
+            load(t, 0, RAX);
+            e.bytes({0x49, 0x01, 0xC2}); // add r10, rax
+            break;
+        case opcode::jnz:
+        case opcode::jz: {
+            auto taken_if_nonzero = t.d.op == opcode::jnz;
+            auto jump_to_target = [&] {
+                if (t.d.modes[1] == param_mode::immediate) {
+                    exits.push_back({e.jump({0xE9}), mem_index(t.p[1])});
+                } else {
+                    load(t, 1, RDX);
+                    e.bytes({0x48, 0x89, 0x57, OFF_PC}); // mov [rdi+pc], rdx
+                    to_epilogue.push_back(e.jump({0xE9}));
+                }
+            };
+            if (t.d.modes[0] == param_mode::immediate) {
+                if ((t.p[0] != 0) == taken_if_nonzero)
+                    jump_to_target();
+                break;
+            }
+            load(t, 0, RAX);
+            e.bytes({0x48, 0x85, 0xC0}); // test rax, rax
+            // skip the taken path if the condition does not hold
+            auto skip = e.jump({0x0F, uint8_t(taken_if_nonzero ? 0x84 : 0x85)});
+            jump_to_target();
+            e.patch(skip, e.code.size());
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    // falling off the end of the trace
+    exits.push_back({e.jump({0xE9}), pc});
+
+    // exits to pcs inside the trace become direct jumps
+    map<mem_index, vector<size_t>> exit_stubs;
+    for (auto &[at, target] : exits) {
+        if (auto l = labels.find(target); l != labels.end())
+            e.patch(at, l->second);
+        else
+            exit_stubs[target].push_back(at);
+    }
+    for (auto &[target, ats] : exit_stubs) {
+        for (auto at : ats)
+            e.patch(at, e.code.size());
+        e.bytes({0x48, 0xC7, 0x47, OFF_PC}); // mov qword [rdi+pc], imm32
+        e.imm32(target);
+        to_epilogue.push_back(e.jump({0xE9}));
+    }
+    map<mem_index, vector<size_t>> bail_stubs;
+    for (auto &[at, bail_pc] : bails)
+        bail_stubs[bail_pc].push_back(at);
+    for (auto &[bail_pc, ats] : bail_stubs) {
+        for (auto at : ats)
+            e.patch(at, e.code.size());
+        e.bytes({0x48, 0xC7, 0x47, OFF_PC}); // mov qword [rdi+pc], imm32
+        e.imm32(bail_pc);
+        e.bytes({0x48, 0xC7, 0x47, OFF_BAILED}); // mov qword [rdi+bailed], 1
+        e.imm32(1);
+        to_epilogue.push_back(e.jump({0xE9}));
+    }
+    for (auto at : to_epilogue)
+        e.patch(at, e.code.size());
+    e.bytes({0x4C, 0x89, 0x57, OFF_REL}); // mov [rdi+rel], r10
+    e.bytes({0xC3});                       // ret
+
+    jit_trace trace = {entry, pc};
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    trace.page_size = (e.code.size() + page - 1) / page * page;
+    trace.page = mmap(nullptr, trace.page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (trace.page == MAP_FAILED)
+        return {};
+    memcpy(trace.page, e.code.data(), e.code.size());
+    if (mprotect(trace.page, trace.page_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(trace.page, trace.page_size);
+        return {};
+    }
+    trace.fn = reinterpret_cast<void (*)(jit_state *)>(trace.page);
+    return trace;
+}
+
+jit_trace const *jit_cache::trace_at(machine &m, mem_index pc) {
+    // only code in dense pages is compiled
+    if (size_t(pc) >= m.mem.dense_size())
+        return nullptr;
+    if (pc >= mem_index(trace_at_.size())) {
+        trace_at_.resize(m.mem.dense_size(), NONE);
+        heat_.resize(m.mem.dense_size(), 0);
+        code_map.resize(m.mem.dense_size(), 0);
+    }
+    auto &i = trace_at_[pc];
+    if (i >= 0)
+        return &traces_[i];
+    if (i == UNCOMPILABLE || ++heat_[pc] < HOT_THRESHOLD)
+        return nullptr;
+    auto t = compile(m, pc);
+    if (!t) {
+        i = UNCOMPILABLE;
+        return nullptr;
+    }
+    n_compiled++;
+    if (free_.empty()) {
+        i = int32_t(traces_.size());
+        traces_.push_back(*t);
+    } else {
+        i = free_.back(), free_.pop_back();
+        traces_[size_t(i)] = *t;
+    }
+    for (auto a : nums(t->from, t->to))
+        code_map[a] = 1;
+    return &traces_[size_t(i)];
+}
+
+void jit_cache::invalidate(mem_index i) {
+    for (auto &t : traces_)
+        if (t.fn && t.from <= i && i < t.to) {
+            free_.push_back(trace_at_[t.from]);
+            trace_at_[t.from] = NONE;
+            heat_[t.from] = 0;
+            release(t);
+            n_invalidated++;
+        }
+    fill(code_map.begin(), code_map.end(), 0);
+    for (auto &t : traces_)
+        if (t.fn)
+            for (auto a : nums(t.from, t.to))
+                code_map[a] = 1;
+}
+
+void machine::jit_on_write(mem_index i) {
+    auto &c = *jit_.p;
+    if (i < mem_index(c.code_map.size()) && c.code_map[i])
+        c.invalidate(i);
+}
+
+/// Runs compiled traces where possible and single-steps everything else
+void machine::run_jit() {
+    if (!jit_.p)
+        jit_.p = make_unique<jit_cache>();
+    auto &c = *jit_.p;
+    while (size_t(i_mem) < mem.size()) {
+        if (auto t = c.trace_at(*this, i_mem)) {
+            // traces write pages in place, so nothing may be shared
+            mem.make_exclusive();
+            if (c.layout != mem.layout() || c.pages.size() != mem.n_pages()) {
+                c.pages.resize(mem.n_pages());
+                for (auto a : nums(0_s, c.pages.size()))
+                    c.pages[a] = mem.page(a);
+                c.layout = mem.layout();
+            }
+            c.code_map.resize(mem.dense_size(), 0);
+            c.state = {c.pages.data(),    int64_t(mem.dense_size()),
+                       relative_offset_, c.code_map.data(),
+                       i_mem,            0};
+            t->fn(&c.state);
+            i_mem = mem_index(c.state.pc);
+            relative_offset_ = mem_index(c.state.rel);
+            if (!c.state.bailed)
+                continue;
+        }
+        if (!step())
+            return;
+    }
+}
+
+#else
+
+class jit_cache {};
+
+jit_handle::~jit_handle() = default;
+jit_handle &jit_handle::operator=(jit_handle &&) = default;
+
+void machine::jit_on_write(mem_index i) {}
+
+/// No JIT on this platform
+void machine::run_jit() { run_jump_table(); }
+
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+#include "_main.hpp"
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// First bytes of a binary program image: the magic, then the number of
+/// words (uint64) and the words themselves (int64, native byte order)
+char const INTBIN_MAGIC[8] = {'I', 'N', 'T', 'B', 'I', 'N', '1', '\0'};
+
+/// A read-only mapping of a whole file
+class mapped_file {
+    int fd_ = -1;
+    void *data_ = nullptr;
+    size_t size_ = 0;
+
+  public:
+    mapped_file(string const &path) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) != 0) {
+            if (fd_ >= 0)
+                close(fd_);
+            cerr << "cannot open " << path << "\n";
+            throw "cannot open program";
+        }
+        size_ = size_t(st.st_size);
+        if (size_ > 0)
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (data_ == MAP_FAILED) {
+            close(fd_);
+            cerr << "cannot map " << path << "\n";
+            throw "cannot map program";
+        }
+    }
+    mapped_file(mapped_file const &) = delete;
+    ~mapped_file() {
+        if (data_)
+            munmap(data_, size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+    char const *data() const { return static_cast<char const *>(data_); }
+    size_t size() const { return size_; }
+};
+
+/**
+ * Loads a program, either as comma-separated text or as a binary image
+ * written by write_intbin(). Text is parsed with from_chars straight out of
+ * the mapped file into a buffer sized by counting the commas.
+ */
+memory load_program(string const &path) {
+    mapped_file f(path);
+    auto first = f.data(), last = f.data() + f.size();
+    if (f.size() >= sizeof(INTBIN_MAGIC) + sizeof(uint64_t) &&
+        memcmp(first, INTBIN_MAGIC, sizeof(INTBIN_MAGIC)) == 0) {
+        uint64_t n;
+        memcpy(&n, first + sizeof(INTBIN_MAGIC), sizeof(n));
+        auto words = first + sizeof(INTBIN_MAGIC) + sizeof(n);
+        if (n > size_t(last - words) / sizeof(mem_val)) {
+            cerr << path << ": truncated image of " << n << " words\n";
+            throw "truncated program image";
+        }
+        memory ops(n);
+        memcpy(ops.data(), words, n * sizeof(mem_val));
+        return ops;
+    }
+    memory ops(size_t(count(first, last, ',')) + 1);
+    size_t n = 0;
+    for (auto p = first; p != last;) {
+        if (*p != '-' && (*p < '0' || *p > '9')) {
+            p++;
+            continue;
+        }
+        if (n == ops.size()) // not separated by commas after all
+            ops.resize(2 * n);
+        auto [end, error] = from_chars(p, last, ops[n]);
+        if (error != errc()) {
+            cerr << path << ": bad number at byte " << p - first << "\n";
+            throw "bad program";
+        }
+        n++, p = end;
+    }
+    ops.resize(n);
+    return ops;
+}
+
+/// Writes ops as a binary image that load_program() reads without parsing
+void write_intbin(string const &path, memory const &ops) {
+    ofstream out(path, ios::binary);
+    uint64_t n = ops.size();
+    out.write(INTBIN_MAGIC, sizeof(INTBIN_MAGIC));
+    out.write(reinterpret_cast<char const *>(&n), sizeof(n));
+    out.write(reinterpret_cast<char const *>(ops.data()),
+              streamsize(n * sizeof(mem_val)));
+    if (!out) {
+        cerr << "cannot write " << path << "\n";
+        throw "cannot write program image";
+    }
+}
@@ -0,0 +1,210 @@
+#pragma once
+#include "_intcode.hpp"
+#include <mutex>
+
+/// First bytes of a cache file; see memoized_program::save()
+char const MEMO_MAGIC[8] = {'I', 'N', 'T', 'M', 'E', 'M', 'O', '1'};
+
+/**
+ * A program used as a pure function: every run starts from the image, reads
+ * a fixed number of inputs and outputs a fixed number of values before it
+ * halts (like the day 19 drone). Results are cached in an open-addressing
+ * hash table, so each input tuple runs only once; with a cache path they
+ * are also kept on disk for later runs of the same program.
+ *
+ * Purity is checked on the first run: the program has to halt after reading
+ * exactly its inputs, which makes the output count fixed; any later run
+ * with a different count throws. Safe to call from several threads.
+ */
+class memoized_program {
+    machine const program_;
+    size_t n_in_, n_out_ = 0;
+    bool checked_ = false;
+    string cache_path_;
+    uint64_t image_hash_;
+
+    /// open addressing with linear probing; slot i holds the inputs at
+    /// keys_[i * n_in_], the outputs at values_[i * n_out_]
+    vector<mem_val> keys_, values_;
+    vector<bool> used_;
+    size_t size_ = 0, runs_ = 0;
+    bool dirty_ = false;
+    mutex lock_;
+
+    static uint64_t mix(uint64_t h) { // splitmix64 finalizer
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+        return h ^ (h >> 31);
+    }
+    static uint64_t hash(mem_val const *words, size_t n) {
+        uint64_t h = n;
+        for (size_t i = 0; i < n; i++)
+            h = mix(h ^ uint64_t(words[i]));
+        return h;
+    }
+    size_t capacity() const { return used_.size(); }
+    /// The slot holding inputs, or the empty slot where they belong
+    size_t find(mem_val const *inputs) const {
+        auto mask = capacity() - 1;
+        for (auto i = hash(inputs, n_in_) & mask;; i = (i + 1) & mask)
+            if (!used_[i] || equal(inputs, inputs + n_in_,
+                                   keys_.begin() + ptrdiff_t(i * n_in_)))
+                return i;
+    }
+    void insert(mem_val const *inputs, mem_val const *outputs);
+    void rehash(size_t new_capacity);
+    io_buffer run(vector<mem_val> const &inputs);
+    void load();
+
+  public:
+    memoized_program(memory const &image, size_t n_inputs,
+                     string cache_path = "")
+        : program_(image), n_in_(n_inputs), cache_path_(move(cache_path)),
+          image_hash_(hash(image.data(), image.size())) {
+        rehash(64);
+        if (!cache_path_.empty())
+            load();
+    }
+    memoized_program(memoized_program const &) = delete;
+    ~memoized_program() {
+        // nothing may escape a destructor; save() already reported why
+        try {
+            if (dirty_)
+                save();
+        } catch (...) {
+            cerr << "memoized results were not saved\n";
+        }
+    }
+
+    /// The outputs of the program for these inputs
+    vector<mem_val> operator()(vector<mem_val> const &inputs);
+    /// Cached results
+    size_t size() const { return size_; }
+    /// Times the program actually ran
+    size_t runs() const { return runs_; }
+    /// Writes the cache file, throws if it cannot. The destructor also saves
+    /// if needed, but only logs a failure.
+    void save();
+};
+
+void memoized_program::rehash(size_t new_capacity) {
+    auto keys = move(keys_), values = move(values_);
+    auto used = move(used_);
+    keys_.assign(new_capacity * n_in_, 0);
+    values_.assign(new_capacity * n_out_, 0);
+    used_.assign(new_capacity, false);
+    size_ = 0;
+    for (size_t i = 0; i < used.size(); i++)
+        if (used[i])
+            insert(&keys[i * n_in_], &values[i * n_out_]);
+}
+
+void memoized_program::insert(mem_val const *inputs, mem_val const *outputs) {
+    if (2 * (size_ + 1) > capacity())
+        rehash(2 * capacity());
+    auto i = find(inputs);
+    if (used_[i])
+        return;
+    used_[i] = true;
+    copy_n(inputs, n_in_, keys_.begin() + ptrdiff_t(i * n_in_));
+    copy_n(outputs, n_out_, values_.begin() + ptrdiff_t(i * n_out_));
+    size_++;
+}
+
+/// Runs the program from scratch, checking that it behaves like a function
+io_buffer memoized_program::run(vector<mem_val> const &inputs) {
+    auto m = program_.fork_detached();
+    auto out = m.run_code(io_buffer(inputs.begin(), inputs.end()));
+    {
+        lock_guard l(lock_);
+        program_.join_profile(m);
+    }
+    if (!m.halted_ || !m.input_.empty()) {
+        cerr << "memoized program did not halt after reading exactly "
+             << n_in_ << " inputs\n";
+        throw "program is not a pure function";
+    }
+    return out;
+}
+
+vector<mem_val> memoized_program::operator()(vector<mem_val> const &inputs) {
+    if (inputs.size() != n_in_) {
+        cerr << "memoized program takes " << n_in_ << " inputs, got "
+             << inputs.size() << "\n";
+        throw "wrong number of inputs";
+    }
+    {
+        lock_guard l(lock_);
+        if (checked_) {
+            auto i = find(inputs.data());
+            if (used_[i]) {
+                auto first = values_.begin() + ptrdiff_t(i * n_out_);
+                return {first, first + ptrdiff_t(n_out_)};
+            }
+        }
+    }
+    auto out = run(inputs);
+    lock_guard l(lock_);
+    runs_++;
+    if (!checked_) {
+        n_out_ = out.size(), checked_ = true;
+        rehash(capacity());
+    } else if (out.size() != n_out_) {
+        cerr << "memoized program output " << out.size()
+             << " values instead of " << n_out_ << "\n";
+        throw "program is not a pure function";
+    }
+    vector<mem_val> r(out.begin(), out.end());
+    insert(inputs.data(), r.data());
+    dirty_ = true;
+    return r;
+}
+
+/**
+ * Cache file: MEMO_MAGIC, then the hash of the program image, the number
+ * of inputs and of outputs and of entries (uint64 each), then every entry as
+ * its inputs followed by its outputs. Files of other programs are ignored.
+ */
+void memoized_program::save() {
+    lock_guard l(lock_);
+    if (cache_path_.empty() || !checked_)
+        return;
+    ofstream out(cache_path_, ios::binary);
+    auto put = [&](auto const *p, size_t n) {
+        out.write(reinterpret_cast<char const *>(p),
+                  streamsize(n * sizeof(*p)));
+    };
+    uint64_t header[] = {image_hash_, n_in_, n_out_, size_};
+    put(MEMO_MAGIC, sizeof(MEMO_MAGIC));
+    put(header, 4);
+    for (size_t i = 0; i < capacity(); i++)
+        if (used_[i]) {
+            put(&keys_[i * n_in_], n_in_);
+            put(&values_[i * n_out_], n_out_);
+        }
+    if (!out) {
+        cerr << "cannot write " << cache_path_ << "\n";
+        throw "cannot write cache";
+    }
+    dirty_ = false;
+}
+
+void memoized_program::load() {
+    ifstream in(cache_path_, ios::binary);
+    char magic[sizeof(MEMO_MAGIC)];
+    uint64_t header[4];
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!in || !equal(magic, magic + sizeof(magic), MEMO_MAGIC) ||
+        header[0] != image_hash_ || header[1] != n_in_)
+        return;
+    n_out_ = header[2], checked_ = true;
+    rehash(capacity());
+    vector<mem_val> entry(n_in_ + n_out_);
+    for (uint64_t e = 0; e < header[3]; e++) {
+        if (!in.read(reinterpret_cast<char *>(entry.data()),
+                     streamsize(entry.size() * sizeof(mem_val))))
+            break;
+        insert(entry.data(), entry.data() + n_in_);
+    }
+}
@@ -0,0 +1,295 @@
+#pragma once
+#include "_intcode.hpp"
+#include "_parallel.hpp"
+#include <condition_variable>
+#include <mutex>
+
+struct packet {
+    mem_val x, y;
+};
+
+/**
+ * Lock-free multi-producer/single-consumer packet queue (Vyukov's intrusive
+ * queue): push() is one atomic exchange, pop() is only ever called by the
+ * worker that currently runs the receiving NIC.
+ */
+class mailbox {
+    struct node {
+        atomic<node *> next = nullptr;
+        packet p = {};
+    };
+    atomic<node *> head_;
+    node *tail_;
+    node stub_;
+
+    void push(node *n) {
+        n->next.store(nullptr, memory_order_relaxed);
+        auto prev = head_.exchange(n, memory_order_acq_rel);
+        prev->next.store(n, memory_order_release);
+    }
+    packet take(node *n, node *next) {
+        tail_ = next;
+        auto p = n->p;
+        delete n;
+        return p;
+    }
+
+  public:
+    mailbox() : head_(&stub_), tail_(&stub_) {}
+    mailbox(mailbox const &) = delete;
+    ~mailbox() {
+        while (pop())
+            ;
+    }
+
+    void push(packet p) {
+        auto n = new node;
+        n->p = p;
+        push(n);
+    }
+    /// The oldest packet, or none if empty (or a push is only half done,
+    /// whose sender then notifies the receiver again anyway)
+    optional<packet> pop() {
+        auto tail = tail_;
+        auto next = tail->next.load(memory_order_acquire);
+        if (tail == &stub_) {
+            if (!next)
+                return nullopt;
+            tail_ = tail = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next)
+            return take(tail, next);
+        if (tail != head_.load(memory_order_acquire))
+            return nullopt;
+        push(&stub_);
+        next = tail->next.load(memory_order_acquire);
+        if (next)
+            return take(tail, next);
+        return nullopt;
+    }
+};
+
+/**
+ * A network of Intcode NICs (day 23) run on a pool of worker threads.
+ *
+ * A NIC is scheduled when a packet arrives for it and runs until it blocks
+ * on input, on whichever worker picks it up; idle workers steal NICs from
+ * the queues of busy ones. A NIC that read -1 and sent nothing is idle and
+ * not run again until it receives a packet.
+ *
+ * Quiescence is detected by counting credits: scheduling an idle NIC takes
+ * one, a NIC going idle returns its own. Senders take the credit for the
+ * receiver before returning theirs, so the count only reaches zero when no
+ * NIC is queued or running and no packet is in flight.
+ */
+class nic_network {
+  public:
+    /// Called (on a worker thread) for packets to addresses outside the
+    /// network, such as the NAT
+    using external = function<void(mem_val address, packet p)>;
+
+    /// NICs get the addresses first_address, first_address + 1, ...
+    nic_network(memory const &image, size_t n_nics, external on_external,
+                mem_val first_address = 0, size_t n_workers = worker_count());
+    nic_network(nic_network const &) = delete;
+    ~nic_network();
+
+    size_t size() const { return nics_.size(); }
+    bool contains(mem_val address) const {
+        return address >= first_ && address - first_ < mem_val(size());
+    }
+    /// Delivers a packet to the NIC with that address (from any thread)
+    void send(mem_val address, packet p) {
+        deliver(size_t(address - first_), p);
+    }
+    /// Blocks until the whole network is idle
+    void wait_idle();
+    bool idle() const { return credits_ == 0; }
+
+  private:
+    enum nic_state : int { waiting, queued, running, dirty };
+    struct nic {
+        machine m;
+        mailbox inbox;
+        atomic<int> state = waiting;
+        /// output values not yet forming a whole packet
+        vector<mem_val> sent;
+        nic(memory const &image) : m(image) {}
+    };
+    struct worker_queue {
+        mutex lock;
+        deque<size_t> nics;
+    };
+
+    vector<unique_ptr<nic>> nics_;
+    vector<unique_ptr<worker_queue>> queues_;
+    vector<thread> workers_;
+    external on_external_;
+    mem_val first_;
+
+    atomic<size_t> credits_ = 0, queued_ = 0, sleepers_ = 0, next_queue_ = 0;
+    atomic<bool> stop_ = false;
+    mutex lock_;
+    condition_variable work_, idle_;
+
+    static size_t &current_worker() {
+        static thread_local size_t w = SIZE_MAX;
+        return w;
+    }
+    void deliver(size_t n, packet p);
+    void notify(size_t n);
+    void enqueue(size_t n);
+    optional<size_t> take(size_t w);
+    void run(size_t n);
+    void work(size_t w);
+};
+
+nic_network::nic_network(memory const &image, size_t n_nics,
+                         external on_external, mem_val first_address,
+                         size_t n_workers)
+    : on_external_(move(on_external)), first_(first_address) {
+    for (size_t a = 0; a < n_nics; a++) {
+        nics_.push_back(make_unique<nic>(image));
+        nics_[a]->m.input_.push_back(first_ + mem_val(a));
+    }
+    for (size_t w = 0; w < n_workers; w++)
+        queues_.push_back(make_unique<worker_queue>());
+    for (size_t a = 0; a < n_nics; a++)
+        notify(a);
+    for (size_t w = 0; w < n_workers; w++)
+        workers_.emplace_back([this, w] { work(w); });
+}
+
+nic_network::~nic_network() {
+    {
+        lock_guard l(lock_);
+        stop_ = true;
+    }
+    work_.notify_all();
+    for (auto &w : workers_)
+        w.join();
+}
+
+void nic_network::deliver(size_t n, packet p) {
+    nics_[n]->inbox.push(p);
+    // pairs with the fence in run(): either we see the receiver running (or
+    // later) or it sees our packet, never neither
+    atomic_thread_fence(memory_order_seq_cst);
+    notify(n);
+}
+
+void nic_network::wait_idle() {
+    unique_lock l(lock_);
+    idle_.wait(l, [&] { return credits_ == 0; });
+}
+
+/// Makes sure NIC n runs (again) after a packet was delivered to it
+void nic_network::notify(size_t n) {
+    auto &state = nics_[n]->state;
+    for (auto s = state.load();;) {
+        if (s == queued || s == dirty)
+            return;
+        // a running NIC may already have emptied its inbox
+        auto to = s == waiting ? queued : dirty;
+        if (state.compare_exchange_weak(s, to)) {
+            if (s == waiting)
+                credits_++, enqueue(n);
+            return;
+        }
+    }
+}
+
+void nic_network::enqueue(size_t n) {
+    auto w = current_worker();
+    if (w >= queues_.size())
+        w = next_queue_++ % queues_.size();
+    {
+        lock_guard l(queues_[w]->lock);
+        queues_[w]->nics.push_back(n);
+    }
+    queued_++;
+    if (sleepers_ > 0) {
+        lock_guard l(lock_);
+        work_.notify_one();
+    }
+}
+
+/// A NIC from worker w's own queue, or else one stolen from another worker
+optional<size_t> nic_network::take(size_t w) {
+    for (size_t k = 0; k < queues_.size(); k++) {
+        auto &q = *queues_[(w + k) % queues_.size()];
+        lock_guard l(q.lock);
+        if (q.nics.empty())
+            continue;
+        size_t n;
+        if (k == 0)
+            n = q.nics.back(), q.nics.pop_back();
+        else
+            n = q.nics.front(), q.nics.pop_front();
+        queued_--;
+        return n;
+    }
+    return nullopt;
+}
+
+void nic_network::run(size_t n) {
+    auto &c = *nics_[n];
+    auto &m = c.m;
+    c.state = running;
+    atomic_thread_fence(memory_order_seq_cst); // see deliver()
+    while (auto p = c.inbox.pop())
+        m.input_.push_back(p->x), m.input_.push_back(p->y);
+    auto polled = m.input_.empty();
+    if (polled)
+        m.input_.push_back(-1);
+
+    auto sent_any = false;
+    for (auto blocked = false; !blocked;) {
+        blocked = m.run() != stop_reason::output;
+        for (auto s = m.output_.pull(); !s.empty(); s = m.output_.pull())
+            c.sent.insert(c.sent.end(), s.begin(), s.end());
+        size_t i = 0;
+        for (; i + 3 <= c.sent.size(); i += 3) {
+            auto to = c.sent[i];
+            packet p = {c.sent[i + 1], c.sent[i + 2]};
+            if (contains(to))
+                send(to, p);
+            else
+                on_external_(to, p);
+            sent_any = true;
+        }
+        c.sent.erase(c.sent.begin(), c.sent.begin() + mem_index(i));
+    }
+
+    // a NIC that just worked polls again, like on the real network
+    if (!m.halted_ && (sent_any || !polled)) {
+        c.state = queued;
+        enqueue(n);
+        return;
+    }
+    int s = running;
+    if (!c.state.compare_exchange_strong(s, waiting)) {
+        c.state = queued; // got a packet while running
+        enqueue(n);
+        return;
+    }
+    if (--credits_ == 0) {
+        lock_guard l(lock_);
+        idle_.notify_all();
+    }
+}
+
+void nic_network::work(size_t w) {
+    current_worker() = w;
+    while (!stop_) {
+        if (auto n = take(w)) {
+            run(*n);
+            continue;
+        }
+        unique_lock l(lock_);
+        sleepers_++;
+        work_.wait(l, [&] { return queued_ > 0 || stop_; });
+        sleepers_--;
+    }
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include "_main.hpp"
+#include <mutex>
+
+#ifndef INTCODE_PROFILE_JSON
+#define INTCODE_PROFILE_JSON "intcode_profile.json"
+#endif
+
+/// Mnemonic of an opcode, "???" for unknown ones
+char const *opcode_name(opcode op) {
+    switch (op) {
+    case opcode::add:
+        return "add";
+    case opcode::mul:
+        return "mul";
+    case opcode::in:
+        return "in";
+    case opcode::out:
+        return "out";
+    case opcode::jnz:
+        return "jnz";
+    case opcode::jz:
+        return "jz";
+    case opcode::lt:
+        return "lt";
+    case opcode::eq:
+        return "eq";
+    case opcode::crel:
+        return "crel";
+    case opcode::halt:
+        return "halt";
+    }
+    return "???";
+}
+
+/**
+ * Execution counters of a machine (see `make profile=1`). The interpreters
+ * count every instruction by opcode and address, every jump by whether it
+ * was taken, and time every machine::run() slice.
+ *
+ * A profile is shared by a machine and its forks. It is not thread safe:
+ * forks that run on other threads count into their own profile instead (see
+ * machine::fork_detached()), which is merged back after the threads joined.
+ * When the last machine using a profile is gone, its counts are added to
+ * the profile of the whole process (see all_machines()), which is printed
+ * to cerr and written to one JSON file at exit: intcode_profile.json, or
+ * the path given with `make profile_json=<path>`.
+ */
+class machine_profile {
+    using counter = uint64_t;
+    array<counter, 100> per_opcode_ = {};
+    vector<counter> per_pc_;
+    vector<opcode> op_at_;
+    /// per jump address: {not taken, taken}
+    vector<array<counter, 2>> jumps_;
+    vector<chrono::nanoseconds> slices_;
+    counter total_ = 0;
+    bool auto_report_;
+
+    template <class T> static void fit(vector<T> &v, mem_index pc) {
+        if (size_t(pc) >= v.size())
+            v.resize(max(size_t(pc) + 1, 2 * v.size()));
+    }
+
+  public:
+    /// auto_report = false only counts; call report() to see the results
+    machine_profile(bool auto_report = true) : auto_report_(auto_report) {}
+    machine_profile(machine_profile const &) = delete;
+    ~machine_profile();
+    counter instructions() const { return total_; }
+
+    void count(mem_index pc, opcode op) {
+        total_++;
+        if (size_t(op) < per_opcode_.size())
+            per_opcode_[size_t(op)]++;
+        fit(per_pc_, pc), fit(op_at_, pc);
+        per_pc_[size_t(pc)]++;
+        op_at_[size_t(pc)] = op;
+    }
+    void jump(mem_index pc, bool taken) {
+        fit(jumps_, pc);
+        jumps_[size_t(pc)][taken]++;
+    }
+    void slice(chrono::nanoseconds took) { slices_.push_back(took); }
+    /// Adds the counts and time slices of p
+    void merge(machine_profile const &p);
+
+    /// Prints the hot-spot report and writes the JSON file
+    void report() {
+        string path = INTCODE_PROFILE_JSON;
+        ofstream json(path);
+        write_json(json);
+        // machines may halt on several threads at once
+        ostringstream text;
+        print(text);
+        text << "(written to " << path << ")\n";
+        static mutex cerr_lock;
+        lock_guard lock(cerr_lock);
+        cerr << text.str();
+    }
+
+    void print(ostream &o) const;
+    void write_json(ostream &o) const;
+
+  private:
+    /// The (at most n) addresses with the highest nonzero count
+    template <class F> vector<mem_index> hottest(size_t n, F count) const {
+        vector<mem_index> r;
+        for (size_t pc = 0; pc < per_pc_.size(); pc++)
+            if (count(pc) > 0)
+                r.push_back(mem_index(pc));
+        stable_sort(r.begin(), r.end(),
+                    [&](auto a, auto b) { return count(a) > count(b); });
+        if (r.size() > n)
+            r.resize(n);
+        return r;
+    }
+    chrono::nanoseconds total_time() const {
+        return accumulate(slices_.begin(), slices_.end(),
+                          chrono::nanoseconds(0));
+    }
+    counter jump_count(size_t pc) const {
+        return pc < jumps_.size() ? jumps_[pc][0] + jumps_[pc][1] : 0;
+    }
+};
+
+/// The profiles of all machines of the process, reported at exit
+class process_profile {
+    machine_profile all_{false};
+    mutex lock_;
+
+  public:
+    /// Adds p; machines may be gone on several threads at once
+    void add(machine_profile const &p) {
+        lock_guard lock(lock_);
+        all_.merge(p);
+    }
+    ~process_profile() {
+        if (all_.instructions() > 0)
+            all_.report();
+    }
+};
+
+process_profile &all_machines() {
+    static process_profile p;
+    return p;
+}
+
+machine_profile::~machine_profile() {
+    if (auto_report_ && total_ > 0)
+        all_machines().add(*this);
+}
+
+void machine_profile::merge(machine_profile const &p) {
+    total_ += p.total_;
+    for (size_t a = 0; a < per_opcode_.size(); a++)
+        per_opcode_[a] += p.per_opcode_[a];
+    for (size_t pc = 0; pc < p.per_pc_.size(); pc++)
+        if (p.per_pc_[pc]) {
+            fit(per_pc_, mem_index(pc)), fit(op_at_, mem_index(pc));
+            per_pc_[pc] += p.per_pc_[pc];
+            op_at_[pc] = p.op_at_[pc];
+        }
+    for (size_t pc = 0; pc < p.jumps_.size(); pc++) {
+        fit(jumps_, mem_index(pc));
+        jumps_[pc][0] += p.jumps_[pc][0], jumps_[pc][1] += p.jumps_[pc][1];
+    }
+    slices_.insert(slices_.end(), p.slices_.begin(), p.slices_.end());
+}
+
+void machine_profile::print(ostream &o) const {
+    auto share = [&](counter n) {
+        return to_string(total_ ? 100 * n / total_ : 0) + "%";
+    };
+    o << "--- Intcode profile: " << total_
+      << " instructions in " << slices_.size() << " slices, "
+      << total_time().count() / 1000 << " us ---\n";
+    if (!slices_.empty()) {
+        auto sorted = slices_;
+        sort(sorted.begin(), sorted.end());
+        o << "slices: median " << sorted[sorted.size() / 2].count() / 1000
+          << " us, max " << sorted.back().count() / 1000 << " us\n";
+    }
+    vector<size_t> ops;
+    for (size_t a = 0; a < per_opcode_.size(); a++)
+        if (per_opcode_[a])
+            ops.push_back(a);
+    stable_sort(ops.begin(), ops.end(), [&](auto a, auto b) {
+        return per_opcode_[a] > per_opcode_[b];
+    });
+    o << "opcodes:\n";
+    for (auto a : ops)
+        o << "  " << setw(5) << opcode_name(opcode(a)) << setw(12)
+          << per_opcode_[a] << setw(5) << share(per_opcode_[a]) << "\n";
+    o << "hot spots:\n";
+    for (auto pc : hottest(20, [&](size_t a) { return per_pc_[a]; })) {
+        auto n = per_pc_[size_t(pc)];
+        o << "  " << setw(6) << pc << " " << setw(5)
+          << opcode_name(op_at_[size_t(pc)]) << setw(12) << n << setw(5)
+          << share(n) << "\n";
+    }
+    o << "jumps (taken / not taken):\n";
+    for (auto pc : hottest(20, [&](size_t a) { return jump_count(a); }))
+        o << "  " << setw(6) << pc << " " << setw(5)
+          << opcode_name(op_at_[size_t(pc)]) << setw(12)
+          << jumps_[size_t(pc)][1] << " / " << jumps_[size_t(pc)][0] << "\n";
+}
+
+void machine_profile::write_json(ostream &o) const {
+    o << "{\n  \"instructions\": " << total_ << ",\n  \"opcodes\": {";
+    auto first = true;
+    for (size_t a = 0; a < per_opcode_.size(); a++)
+        if (per_opcode_[a]) {
+            o << (first ? "" : ", ") << "\"" << opcode_name(opcode(a))
+              << "\": " << per_opcode_[a];
+            first = false;
+        }
+    o << "},\n  \"pcs\": [";
+    first = true;
+    auto n_pcs = per_pc_.size();
+    for (auto pc : hottest(n_pcs, [&](size_t a) { return per_pc_[a]; })) {
+        o << (first ? "" : ", ") << "{\"pc\": " << pc << ", \"op\": \""
+          << opcode_name(op_at_[size_t(pc)])
+          << "\", \"count\": " << per_pc_[size_t(pc)] << "}";
+        first = false;
+    }
+    o << "],\n  \"jumps\": [";
+    first = true;
+    for (auto pc : hottest(n_pcs, [&](size_t a) { return jump_count(a); })) {
+        o << (first ? "" : ", ") << "{\"pc\": " << pc
+          << ", \"taken\": " << jumps_[size_t(pc)][1]
+          << ", \"not_taken\": " << jumps_[size_t(pc)][0] << "}";
+        first = false;
+    }
+    o << "],\n  \"slices_ns\": [";
+    first = true;
+    for (auto t : slices_) {
+        o << (first ? "" : ", ") << t.count();
+        first = false;
+    }
+    o << "]\n}\n";
+}
@@ -0,0 +1,263 @@
+#pragma once
+#include "_intcode_network.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/// A packet on its way between processes
+struct routed_packet {
+    mem_val to;
+    packet p;
+};
+
+/**
+ * Single-producer/single-consumer ring of packets living in shared memory.
+ * Only lock-free atomics are used, which work across processes.
+ */
+class shm_ring {
+    static size_t const CAPACITY = 1 << 12;
+    atomic<uint64_t> head_, tail_;
+    array<routed_packet, CAPACITY> slots_;
+
+  public:
+    /// Appends e, waiting while the ring is full
+    void push(routed_packet e) {
+        auto t = tail_.load(memory_order_relaxed);
+        while (t - head_.load(memory_order_acquire) == CAPACITY)
+            this_thread::yield();
+        slots_[t % CAPACITY] = e;
+        tail_.store(t + 1, memory_order_release);
+    }
+    optional<routed_packet> pop() {
+        auto h = head_.load(memory_order_relaxed);
+        if (h == tail_.load(memory_order_acquire))
+            return nullopt;
+        auto e = slots_[h % CAPACITY];
+        head_.store(h + 1, memory_order_release);
+        return e;
+    }
+};
+static_assert(atomic<uint64_t>::is_always_lock_free);
+
+/**
+ * Day 23 network spread over several processes. NICs are partitioned into
+ * contiguous address blocks, one nic_network per child process; this process
+ * is the coordinator and receives the packets to all other addresses (the
+ * NAT). Every pair of processes has its own shm_ring in one shm_open segment.
+ *
+ * Quiescence: every process publishes how many packets it sent and received,
+ * whether it is idle (its network is idle and its rings are empty), and an
+ * epoch that changes whenever it receives something. The coordinator takes
+ * two scans; if both see every process idle, as many packets received as
+ * sent, and the same counters, nothing can be in flight.
+ *
+ * A crashing NIC process takes only itself down; the coordinator notices
+ * and reports it instead of waiting forever.
+ */
+class process_network {
+  public:
+    using external = nic_network::external;
+
+    process_network(memory const &image, size_t n_nics, size_t n_processes,
+                    external on_external);
+    process_network(process_network const &) = delete;
+    ~process_network();
+
+    /// Sends a packet to a NIC (coordinator only)
+    void send(mem_val address, packet p);
+    /// Delivers packets for the coordinator until the network is idle
+    void wait_idle();
+
+  private:
+    struct endpoint {
+        atomic<uint64_t> sent, received, epoch;
+        atomic<bool> idle;
+    };
+    struct segment {
+        atomic<bool> stop;
+        size_t n_endpoints;
+        /// then: n_endpoints endpoints, n_endpoints^2 rings
+    };
+    using counters = vector<uint64_t>;
+
+    size_t n_nics_, n_processes_;
+    size_t bytes_;
+    segment *shm_;
+    vector<pid_t> children_;
+    external on_external_;
+
+    endpoint &status(size_t e) {
+        return reinterpret_cast<endpoint *>(shm_ + 1)[e];
+    }
+    shm_ring &ring(size_t from, size_t to) {
+        auto rings = reinterpret_cast<shm_ring *>(
+            reinterpret_cast<endpoint *>(shm_ + 1) + shm_->n_endpoints);
+        return rings[from * shm_->n_endpoints + to];
+    }
+    /// Endpoint of the coordinator
+    size_t coordinator() const { return n_processes_; }
+    mem_val first_address(size_t k) const {
+        return mem_val(k * n_nics_ / n_processes_);
+    }
+    /// Endpoint that receives packets for an address
+    size_t owner(mem_val address) const {
+        if (address < 0 || address >= mem_val(n_nics_))
+            return coordinator();
+        size_t k = 0;
+        while (address >= first_address(k + 1))
+            k++;
+        return k;
+    }
+    void post(size_t from, routed_packet e) {
+        status(from).sent++;
+        ring(from, owner(e.to)).push(e);
+    }
+    void serve(memory const &image, size_t k);
+    optional<counters> scan();
+    void check_children();
+};
+
+process_network::process_network(memory const &image, size_t n_nics,
+                                 size_t n_processes, external on_external)
+    : n_nics_(n_nics), n_processes_(n_processes),
+      on_external_(move(on_external)) {
+    auto n_endpoints = n_processes + 1;
+    bytes_ = sizeof(segment) + n_endpoints * sizeof(endpoint) +
+             n_endpoints * n_endpoints * sizeof(shm_ring);
+    auto name = "/intcode_network_" + to_string(getpid());
+    auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        cerr << "cannot create shared memory " << name << "\n";
+        throw "cannot create shared memory";
+    }
+    if (ftruncate(fd, off_t(bytes_)) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        cerr << "cannot size shared memory " << name << "\n";
+        throw "cannot create shared memory";
+    }
+    auto p = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    // the mapping stays valid (also in the children) without the name
+    shm_unlink(name.c_str());
+    if (p == MAP_FAILED) {
+        cerr << "cannot map shared memory " << name << "\n";
+        throw "cannot map shared memory";
+    }
+    // ftruncate zero-fills, which is a valid initial state for everything
+    shm_ = static_cast<segment *>(p);
+    shm_->n_endpoints = n_endpoints;
+
+    cout.flush(), cerr.flush();
+    for (size_t k = 0; k < n_processes; k++) {
+        auto pid = fork();
+        if (pid < 0) {
+            cerr << "fork failed\n";
+            throw "fork failed";
+        }
+        if (pid == 0) {
+            // don't outlive the coordinator, whatever happens to it
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() == 1)
+                _exit(1);
+            serve(image, k);
+            _exit(0);
+        }
+        children_.push_back(pid);
+    }
+}
+
+process_network::~process_network() {
+    shm_->stop = true;
+    for (auto pid : children_)
+        waitpid(pid, nullptr, 0);
+    munmap(shm_, bytes_);
+}
+
+/// Main loop of NIC process k: moves packets between its rings and network
+void process_network::serve(memory const &image, size_t k) {
+    mutex post_lock; // one producer per ring
+    auto first = first_address(k);
+    nic_network network(
+        image, size_t(first_address(k + 1) - first),
+        [&](mem_val to, packet p) {
+            lock_guard l(post_lock);
+            post(k, {to, p});
+        },
+        first);
+    auto &me = status(k);
+    while (!shm_->stop) {
+        auto got = false;
+        for (size_t from = 0; from < shm_->n_endpoints; from++)
+            while (auto e = ring(from, k).pop()) {
+                if (!got)
+                    me.idle = false, me.epoch++;
+                got = true;
+                network.send(e->to, e->p);
+                me.received++;
+            }
+        if (!got) {
+            me.idle = network.idle();
+            this_thread::sleep_for(chrono::microseconds(20));
+        }
+    }
+}
+
+/// The counters of all NIC processes if they look quiescent
+optional<process_network::counters> process_network::scan() {
+    counters r;
+    uint64_t sent = 0, received = 0;
+    for (size_t e = 0; e < shm_->n_endpoints; e++) {
+        auto &s = status(e);
+        if (e != coordinator() && !s.idle)
+            return nullopt;
+        r.push_back(s.sent), r.push_back(s.received), r.push_back(s.epoch);
+        sent += r[r.size() - 3], received += r[r.size() - 2];
+    }
+    if (sent != received)
+        return nullopt;
+    return r;
+}
+
+void process_network::check_children() {
+    // only our own NIC processes: the program may have other children
+    int status = 0;
+    auto dead = find_if(children_.begin(), children_.end(), [&](pid_t c) {
+        return waitpid(c, &status, WNOHANG) > 0;
+    });
+    if (dead == children_.end())
+        return;
+    auto pid = *dead;
+    cerr << "NIC process " << pid << " died"
+         << (WIFSIGNALED(status) ? " by signal " : " with status ")
+         << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status))
+         << "\n";
+    children_.erase(dead);
+    // stop the others now, the exception may well end the program
+    shm_->stop = true;
+    for (auto c : children_)
+        waitpid(c, nullptr, 0);
+    children_.clear();
+    throw "NIC process died";
+}
+
+void process_network::send(mem_val address, packet p) {
+    post(coordinator(), {address, p});
+}
+
+void process_network::wait_idle() {
+    auto &me = status(coordinator());
+    while (true) {
+        for (size_t from = 0; from < n_processes_; from++)
+            while (auto e = ring(from, coordinator()).pop()) {
+                on_external_(e->to, e->p);
+                me.received++;
+            }
+        check_children();
+        if (auto a = scan(); a && scan() == a)
+            return;
+        this_thread::sleep_for(chrono::microseconds(20));
+    }
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include "_intcode.hpp"
+
+/**
+ * Polynomial in the symbolic inputs x0, x1, ... of a program. Coefficients
+ * wrap around like machine words, so evaluating the polynomial gives exactly
+ * what the machine computes, overflow included. A polynomial can also be
+ * unknown (e.g. a value read from an address that depends on a variable),
+ * which is fine as long as nothing uses it.
+ */
+class polynomial {
+    /// exponent of each variable
+    using monomial = vector<int>;
+    map<monomial, uint64_t> terms_;
+    bool unknown_ = false;
+
+    void add_term(monomial m, uint64_t c) {
+        while (!m.empty() && m.back() == 0)
+            m.pop_back();
+        if ((terms_[m] += c) == 0)
+            terms_.erase(m);
+    }
+
+  public:
+    polynomial(mem_val c = 0) {
+        if (c != 0)
+            terms_[{}] = uint64_t(c);
+    }
+    static polynomial variable(int i) {
+        polynomial p;
+        monomial m(size_t(i) + 1, 0);
+        m.back() = 1;
+        p.terms_[m] = 1;
+        return p;
+    }
+
+    static polynomial unknown() {
+        polynomial p;
+        p.unknown_ = true;
+        return p;
+    }
+
+    bool known() const { return !unknown_; }
+    size_t terms() const { return terms_.size(); }
+    /// The value if the polynomial does not depend on any variable
+    optional<mem_val> constant() const {
+        if (unknown_)
+            return nullopt;
+        if (terms_.empty())
+            return 0;
+        if (terms_.size() == 1 && terms_.begin()->first.empty())
+            return mem_val(terms_.begin()->second);
+        return nullopt;
+    }
+    int degree(int var) const {
+        auto d = 0;
+        for (auto &[m, c] : terms_)
+            if (size_t(var) < m.size())
+                d = max(d, m[size_t(var)]);
+        return d;
+    }
+    /// Coefficient of var^k, as a polynomial in the other variables
+    polynomial coefficient(int var, int k) const {
+        polynomial r;
+        for (auto &[m, c] : terms_)
+            if ((size_t(var) < m.size() ? m[size_t(var)] : 0) == k) {
+                auto rest = m;
+                if (size_t(var) < rest.size())
+                    rest[size_t(var)] = 0;
+                r.add_term(move(rest), c);
+            }
+        return r;
+    }
+    /// Replaces variable var by the value val
+    polynomial substitute(int var, mem_val val) const {
+        polynomial r;
+        for (auto &[m, c] : terms_) {
+            auto f = c;
+            auto rest = m;
+            if (size_t(var) < rest.size()) {
+                for (auto k = 0; k < rest[size_t(var)]; k++)
+                    f *= uint64_t(val);
+                rest[size_t(var)] = 0;
+            }
+            r.add_term(move(rest), f);
+        }
+        return r;
+    }
+
+    polynomial operator+(polynomial const &p) const {
+        if (unknown_ || p.unknown_)
+            return unknown();
+        auto r = *this;
+        for (auto &[m, c] : p.terms_)
+            r.add_term(m, c);
+        return r;
+    }
+    polynomial operator*(polynomial const &p) const {
+        if (unknown_ || p.unknown_)
+            return unknown();
+        polynomial r;
+        for (auto &[ma, ca] : terms_)
+            for (auto &[mb, cb] : p.terms_) {
+                monomial m(max(ma.size(), mb.size()), 0);
+                for (size_t i = 0; i < m.size(); i++)
+                    m[i] = (i < ma.size() ? ma[i] : 0) +
+                           (i < mb.size() ? mb[i] : 0);
+                r.add_term(move(m), ca * cb);
+            }
+        return r;
+    }
+
+    friend ostream &operator<<(ostream &o, polynomial const &p) {
+        if (p.unknown_)
+            return o << "?";
+        if (p.terms_.empty())
+            return o << "0";
+        auto first = true;
+        for (auto it = p.terms_.rbegin(); it != p.terms_.rend(); ++it) {
+            auto &[m, c] = *it;
+            o << (first ? "" : " + ") << mem_val(c);
+            for (size_t i = 0; i < m.size(); i++)
+                if (m[i] > 0)
+                    o << "*x" << i << (m[i] > 1 ? "^" + to_string(m[i]) : "");
+            first = false;
+        }
+        return o;
+    }
+};
+
+/**
+ * Runs a program with some of its cells replaced by variables, keeping every
+ * cell as a polynomial in them. This works as long as everything that steers
+ * the program (opcodes, addresses, jump conditions, comparisons, the relative
+ * base) stays constant, which is the case for straight-line programs like
+ * day 2. Programs doing I/O are not supported.
+ */
+class symbolic_machine {
+    vector<polynomial> mem_;
+    mem_index i_mem_ = 0;
+    mem_val relative_offset_ = 0;
+
+    polynomial &at(mem_val i) {
+        if (i < 0)
+            throw out_of_range("negative address " + to_string(i));
+        if (size_t(i) >= mem_.size())
+            mem_.resize(size_t(i) + 1);
+        return mem_[size_t(i)];
+    }
+    optional<mem_val> concrete(mem_val i) { return at(i).constant(); }
+
+  public:
+    /// Polynomials with more terms than this are given up on
+    static size_t const MAX_TERMS = 1024;
+    /// ... as are programs running longer than this
+    static size_t const MAX_STEPS = 10'000'000;
+
+    /// Cell symbols[k] of image becomes the variable xk
+    symbolic_machine(memory const &image, vector<mem_index> const &symbols)
+        : mem_(image.begin(), image.end()) {
+        for (size_t k = 0; k < symbols.size(); k++)
+            at(symbols[k]) = polynomial::variable(int(k));
+    }
+
+    polynomial const &read(mem_index i) { return at(i); }
+
+    /// Runs until halt. @return false if the program does not stay concrete
+    /// (the cells it wrote may still be read() though)
+    bool run();
+};
+
+bool symbolic_machine::run() {
+    for (size_t n = 0; n < MAX_STEPS; n++) {
+        auto word = concrete(i_mem_);
+        if (!word)
+            return false;
+        auto d = decode_word(*word);
+        // address of parameter j, if it does not depend on a variable
+        auto addr = [&](int j) -> optional<mem_val> {
+            auto p = concrete(i_mem_ + 1 + j);
+            if (!p)
+                return nullopt;
+            switch (d.modes[j]) {
+            case param_mode::position:
+                return p;
+            case param_mode::immediate:
+                return i_mem_ + 1 + j;
+            case param_mode::relative:
+                return relative_offset_ + *p;
+            }
+            return nullopt;
+        };
+        switch (d.op) {
+        case opcode::add:
+        case opcode::mul:
+        case opcode::lt:
+        case opcode::eq: {
+            auto a = addr(0), b = addr(1), dst = addr(2);
+            if (!dst)
+                return false;
+            // loads from symbolic addresses give unknown values, since they
+            // may never be used (as in day 2)
+            auto x = a ? at(*a) : polynomial::unknown();
+            auto y = b ? at(*b) : polynomial::unknown();
+            polynomial r;
+            if (d.op == opcode::add)
+                r = x + y;
+            else if (d.op == opcode::mul)
+                r = x * y;
+            else if (auto cx = x.constant(), cy = y.constant(); cx && cy)
+                r = d.op == opcode::lt ? *cx < *cy : *cx == *cy;
+            else // could only be a case distinction
+                r = polynomial::unknown();
+            if (r.terms() > MAX_TERMS)
+                return false;
+            at(*dst) = move(r);
+            i_mem_ += 4;
+            break;
+        }
+        case opcode::jnz:
+        case opcode::jz: {
+            auto a = addr(0), b = addr(1);
+            auto cond = a ? concrete(*a) : nullopt;
+            auto target = b ? concrete(*b) : nullopt;
+            if (!cond || !target)
+                return false;
+            auto taken = (*cond != 0) == (d.op == opcode::jnz);
+            i_mem_ = taken ? mem_index(*target) : i_mem_ + 3;
+            break;
+        }
+        case opcode::crel: {
+            auto a = addr(0);
+            auto v = a ? concrete(*a) : nullopt;
+            if (!v)
+                return false;
+            relative_offset_ += *v;
+            i_mem_ += 2;
+            break;
+        }
+        case opcode::halt:
+            return true;
+        default: // in, out or garbage
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Finds x0, x1 in [0, range) with p(x0, x1) == target. For each x0 the rest
+ * is a polynomial in x1, which is solved directly when it is linear.
+ */
+optional<pair<mem_val, mem_val>> solve_two(polynomial const &p, mem_val target,
+                                           mem_val range) {
+    for (mem_val x0 = 0; x0 < range; x0++) {
+        auto q = p.substitute(0, x0);
+        if (q.degree(1) <= 1) {
+            auto c0 = *q.coefficient(1, 0).constant();
+            auto c1 = *q.coefficient(1, 1).constant();
+            // c1 * x1 == target - c0; c1 == 0 means any x1 (or none)
+            auto rhs = target - c0;
+            if (c1 == 0) {
+                if (rhs == 0)
+                    return pair(x0, mem_val(0));
+                continue;
+            }
+            if (rhs % c1 == 0 && rhs / c1 >= 0 && rhs / c1 < range &&
+                q.substitute(1, rhs / c1).constant() == target)
+                return pair(x0, rhs / c1);
+            continue;
+        }
+        for (mem_val x1 = 0; x1 < range; x1++)
+            if (q.substitute(1, x1).constant() == target)
+                return pair(x0, x1);
+    }
+    return nullopt;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "_main.hpp"
+#include <atomic>
+#include <exception>
+#include <mutex>
+
+/// Number of worker threads to use: one per core
+size_t worker_count() { return max(1u, thread::hardware_concurrency()); }
+
+/**
+ * Calls f(i) for every i in [0, n), spread over all cores. Items are handed
+ * out one at a time, so f can stop early by returning right away once a
+ * shared result is known. With `make parallel=1` this runs on the TBB
+ * scheduler via the parallel STL, else on plain threads. Per-worker state
+ * can live in a thread_local.
+ *
+ * If f throws, no further items are started and the first exception is
+ * rethrown on the calling thread once all workers are done.
+ */
+template <class F> void parallel_for(size_t n, F f) {
+    exception_ptr error;
+    mutex error_lock;
+    atomic<bool> failed = false;
+    auto guarded = [&](size_t i) {
+        if (failed)
+            return;
+        try {
+            f(i);
+        } catch (...) {
+            lock_guard lock(error_lock);
+            if (!error)
+                error = current_exception();
+            failed = true;
+        }
+    };
+#ifdef USE_PARALLEL_STL
+    vector<size_t> items(n);
+    iota(items.begin(), items.end(), 0_s);
+    for_each(execution::par, items.begin(), items.end(), guarded);
+#else
+    atomic<size_t> next = 0;
+    vector<thread> workers;
+    for (size_t w = 0; w < min(n, worker_count()); w++)
+        workers.emplace_back([&] {
+            for (size_t i; !failed && (i = next++) < n;)
+                guarded(i);
+        });
+    for (auto &w : workers)
+        w.join();
+#endif
+    if (error)
+        rethrow_exception(error);
+}
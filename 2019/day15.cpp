@@ -1,330 +1,207 @@
 #include "_main.hpp"
+#include "_intcode.hpp"
+#include "_parallel.hpp"
 #include <chrono>
 #include <thread>
 
-enum class opcode : int {
-    add = 1,
-    mul = 2,
-    in = 3,
-    out = 4,
-    jnz = 5,
-    jz = 6,
-    lt = 7,
-    eq = 8,
-    crel = 9,
-    halt = 99,
-};
-
-using memory = vector<ssize_t>;
-using mem_val = memory::value_type;
-using mem_index = int;
-using param_modes = string;
-using io_buffer = deque<mem_val>;
-
-class machine {
-    pair<opcode, param_modes> parse_mem(mem_val p);
-
-  public:
-    memory mem;
-    mem_index i_mem = 0;
-    io_buffer input_, output_;
-    int status_ = 0;
-    bool halted_ = false;
-    mem_index relative_offset_ = 0;
-
-    machine(memory p_mem) : mem(p_mem) {}
-    io_buffer run_code(io_buffer input);
+struct coord {
+    int x, y;
+    bool operator<(coord const &p) const {
+        return x < p.x || (x == p.x && y < p.y);
+    }
+    bool operator==(coord const &p) const { return x == p.x && y == p.y; }
+    coord operator+(coord const &p) const { return {x + p.x, y + p.y}; }
 };
+ostream &operator<<(ostream &o, coord const &p) {
+    o << p.x << "," << p.y;
+    return o;
+}
 
-class memory_cell {
-    memory &mem_;
-    param_modes const &par_;
-
-    enum modes {
-        position_mode = 0,
-        immediate_mode = 1,
-        relative_mode = 2,
-    };
-
-    modes mode(mem_index j) const {
-        if (par_.size() <= j)
-            return position_mode;
-        else
-            return static_cast<modes>(par_[j] - '0');
+enum { NORTH = 1, SOUTH = 2, WEST = 3, EAST = 4 };
+enum { HIT_WALL = 0, MOVE_DONE = 1, TARGET_FOUND = 2 };
+/// Offsets of the movement commands, by command
+array<coord, 5> const STEP = {{{0, 0}, {0, -1}, {0, 1}, {-1, 0}, {1, 0}}};
+
+/// Map of the area, growing as cells outside of it are set
+class dense_grid {
+    vector<char> cells_;
+    coord min_ = {0, 0};
+    int width_ = 0, height_ = 0;
+    /// bounding box of the cells set so far
+    coord lo_ = {0, 0}, hi_ = {0, 0};
+
+    bool inside(coord p) const {
+        return p.x >= min_.x && p.y >= min_.y && p.x < min_.x + width_ &&
+               p.y < min_.y + height_;
+    }
+    size_t index(coord p) const {
+        return size_t((p.y - min_.y) * width_ + p.x - min_.x);
+    }
+    /// Grows to twice the size around p (or the old area) at least
+    void grow(coord p) {
+        auto lo = coord{min(p.x, min_.x), min(p.y, min_.y)};
+        auto hi = coord{max(p.x + 1, min_.x + width_),
+                        max(p.y + 1, min_.y + height_)};
+        auto w = max(16, 2 * (hi.x - lo.x)), h = max(16, 2 * (hi.y - lo.y));
+        dense_grid g;
+        g.min_ = {lo.x - (w - (hi.x - lo.x)) / 2,
+                  lo.y - (h - (hi.y - lo.y)) / 2};
+        g.width_ = w, g.height_ = h;
+        g.cells_.assign(size_t(w * h), UNKNOWN);
+        for (auto y = min_.y; y < min_.y + height_; y++)
+            for (auto x = min_.x; x < min_.x + width_; x++)
+                g.cells_[g.index({x, y})] = cells_[index({x, y})];
+        *this = move(g);
     }
 
   public:
-    memory_cell(memory &mem, param_modes const &par, mem_index base,
-                mem_index const &offset)
-        : mem_(mem), par_(par), base_(base), offset_(offset) {}
-
-    mem_index const base_;
-    mem_index const offset_;
+    static constexpr char UNKNOWN = ' ', WALL = '#', OPEN = '.', OXYGEN = 'O';
 
-    mem_val &operator[](mem_index j) {
-        if (base_ + j >= mem_index(mem_.size()))
-            mem_.resize(base_ + j + 1, 0);
-        auto &val = mem_.at(base_ + j);
-        // cout << "mem at " << base_ << "+" << j << " = " << val << "\n";
-        switch (mode(j)) {
-        case position_mode:
-            if (val >= mem_index(mem_.size())) {
-                mem_.resize(val + 1); // invalidates references!
-                val = mem_.at(base_ + j);
+    char operator[](coord p) const {
+        return inside(p) ? cells_[index(p)] : UNKNOWN;
+    }
+    void set(coord p, char c) {
+        if (!inside(p))
+            grow(p);
+        cells_[index(p)] = c;
+        lo_ = {min(lo_.x, p.x), min(lo_.y, p.y)};
+        hi_ = {max(hi_.x, p.x + 1), max(hi_.y, p.y + 1)};
+    }
+    coord min_corner() const { return lo_; }
+    coord max_corner() const { return hi_; }
+
+    /**
+     * Distances of all open cells from the nearest source (multi-source
+     * BFS); -1 for cells that cannot be reached.
+     */
+    vector<int> distances(vector<coord> const &sources) const {
+        vector<int> dist(cells_.size(), -1);
+        deque<coord> queue;
+        for (auto s : sources)
+            dist[index(s)] = 0, queue.push_back(s);
+        while (!queue.empty()) {
+            auto p = queue.front();
+            queue.pop_front();
+            for (int dir = NORTH; dir <= EAST; dir++) {
+                auto q = p + STEP[size_t(dir)];
+                if (!inside(q) || (*this)[q] == WALL ||
+                    (*this)[q] == UNKNOWN || dist[index(q)] >= 0)
+                    continue;
+                dist[index(q)] = dist[index(p)] + 1;
+                queue.push_back(q);
             }
-            return mem_.at(val);
-        case immediate_mode:
-            return val;
-        case relative_mode: {
-            auto rel = offset_ + val;
-            if (rel >= mem_index(mem_.size()))
-                mem_.resize(rel + 1);
-            return mem_.at(rel);
-        }
-        default:
-            cerr << "unknown mode " << mode(j) << " in cell " << base_ << "\n";
-            return mem_[-1];
         }
+        return dist;
     }
-};
-
-class instruction {
-  public:
-    using func = function<mem_index(memory_cell, machine &)>;
-    instruction(func p_action) : action(move(p_action)) {}
-    auto operator()(memory_cell c, machine &m) const {
-        return action(move(c), m);
+    int distance(vector<int> const &dist, coord p) const {
+        return inside(p) ? dist[index(p)] : -1;
     }
-
-  private:
-    func action;
-};
-
-/// instruction map
-const map<opcode, instruction> instr = {
-    {opcode::add, {[](auto c, auto &m) {
-         c[2] = c[0] + c[1];
-         return 4;
-     }}},
-    {opcode::mul, {[](auto c, auto &m) {
-         c[2] = c[0] * c[1];
-         return 4;
-     }}},
-    {opcode::in, {[](auto c, auto &m) {
-         if (!m.input_.empty()) {
-             // cout << "reading input " << m.input_.front() << " into " << c[0]
-             //      << "\n";
-             c[0] = m.input_.front();
-             m.input_.pop_back();
-         } else {
-             // cout << "Input a number: ";
-             // int inp;
-             // cin >> inp;
-             // c[0] = inp;
-             // cout << "Awaiting input\n";
-             m.status_ = 2;
-             return 0;
-         }
-         return 2;
-     }}},
-    {opcode::out, {[](auto c, auto &m) {
-         m.output_.push_back(c[0]);
-         return 2;
-     }}},
-    {opcode::jnz, {[](auto c, auto &m) {
-         if (c[0] != 0) {
-             auto r = static_cast<mem_index>(-c.base_ + c[1] + 1);
-             return r;
-         } else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::jz, {[](auto c, auto &m) {
-         if (c[0] == 0)
-             return static_cast<mem_index>(-c.base_ + c[1] + 1);
-         else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::lt, {[](auto c, auto &m) {
-         c[2] = c[0] < c[1];
-         return 4;
-     }}},
-    {opcode::eq, {[](auto c, auto &m) {
-         c[2] = c[0] == c[1];
-         return 4;
-     }}},
-    {opcode::crel, {[](auto c, auto &m) {
-         m.relative_offset_ += c[0];
-         return 2;
-     }}},
 };
 
-pair<opcode, param_modes> machine::parse_mem(mem_val p) {
-    auto str = to_string(p);
-    string op = {str.back()};
-    if (str.size() > 1)
-        op = str[str.size() - 2] + op;
-    param_modes par;
-    for (auto a : nums(0, max(0, int(str.size()) - 2)))
-        par.push_back(str[a]);
-    r::reverse(par);
-    return {static_cast<opcode>(stoi(op)), par};
-}
-
-io_buffer machine::run_code(io_buffer input) {
-    input_ = move(input);
-    output_ = {};
-    while (i_mem < mem.size()) {
-        auto [op, params] = parse_mem(mem[i_mem]);
-        // cout << "instruction " << mem[i_mem] << " = " << int(op) << " with "
-        //     << params << "\n ";
-        if (op == opcode::halt) {
-            halted_ = true;
-            break;
-        }
-        if (auto a = instr.find(op); a != instr.end())
-            i_mem += a->second(
-                memory_cell(mem, params, i_mem + 1, relative_offset_), *this);
-        else {
-            cerr << i_mem << ": unknown opcode " << int(op) << "\n";
-            break;
-        }
-        if (status_ != 0) {
-            status_ = 0;
-            break;
-        }
+void display_tiles(dense_grid const &tiles, coord const &droid) {
+    auto lo = tiles.min_corner(), hi = tiles.max_corner();
+    for (auto y = lo.y; y < hi.y; y++) {
+        for (auto x = lo.x; x < hi.x; x++)
+            cout << (droid == coord{x, y} ? 'D' : tiles[{x, y}]);
+        cout << "\n";
     }
-    return move(output_);
 }
 
-struct coord {
-    int x, y;
-    bool operator<(coord const &p) const {
-        // if (x < p.x)
-        //    return true;
-        // else if (p.x < x)
-        //    return false;
-        // else if (y < p.y)
-        //    return true;
-        // else
-        //    return false;
-        return x < p.x || (x == p.x && y < p.y);
-    }
-    bool operator==(coord const &p) const { return x == p.x && y == p.y; }
+/// An open cell on the BFS frontier with a droid standing on it
+struct explorer {
+    coord at;
+    machine droid;
 };
-ostream &operator<<(ostream &o, coord const &p) {
-    o << p.x << "," << p.y;
-    return o;
-}
 
-void display_tiles(map<coord, char> const &tiles, coord const &droid) {
-    auto [min_coord, max_coord] = pair<coord, coord>{{-20, -20}, {20, 20}};
-    for (auto y = min_coord.y; y <= max_coord.y; y++) {
-        for (auto x = min_coord.x; x <= max_coord.x; x++)
-            if (tiles.find({x, y}) == tiles.end())
-                cout << ' ';
-            else if (droid == coord{x, y})
-                cout << 'D';
-            else
-                cout << tiles.at({x, y});
-        cout << "\n";
-    }
-}
+/// What one step of an explorer found
+struct discovery {
+    coord at;
+    mem_val status;
+    machine droid;
+};
 
 int main(int argc, char **argv) {
     if (argc < 2)
         return 99;
-    ifstream in(argv[1]);
-    memory ops;
-    for (mem_val a = 0; in >> a;) {
-        ops.push_back(a);
-        in.ignore();
-    }
-    enum { NORTH = 1, SOUTH = 2, WEST = 3, EAST = 4 };
-    enum { HIT_WALL = 0, MOVE_DONE = 1, TARGET_FOUND = 2 };
+    auto ops = load_program(argv[1]);
     bool DISPLAY = argc >= 3 && argv[2] == string("-d");
-    machine m(ops);
     coord const STARTING_POS = {0, 0};
-    coord droid = STARTING_POS, next, target;
-    graph g(0);
-    g.add_vertex();
-    map<coord, int> vertices = {{STARTING_POS, 0}};
-    auto i_vertex = 1;
-    map<coord, coord> parent;
-    map<coord, char> tiles = {{STARTING_POS, '.'}};
-    io_buffer input = {};
-    while (!m.halted_) {
-        if (next = {droid.x + 1, droid.y}; tiles.find(next) == tiles.end())
-            input = {EAST};
-        else if (next = {droid.x, droid.y - 1}; tiles.find(next) == tiles.end())
-            input = {NORTH};
-        else if (next = {droid.x - 1, droid.y}; tiles.find(next) == tiles.end())
-            input = {WEST};
-        else if (next = {droid.x, droid.y + 1}; tiles.find(next) == tiles.end())
-            input = {SOUTH};
-        else {
-            if (droid == STARTING_POS) {
-                cerr << "BACK AT STARTING POSITION, DONE\n";
-                break;
+    optional<coord> target;
+    int target_distance = 0;
+    dense_grid tiles;
+    tiles.set(STARTING_POS, dense_grid::OPEN);
+
+    // BFS by levels: every explorer of the frontier tries all unknown
+    // neighbors in clones of its droid, in parallel; the results are merged
+    // into the map afterwards
+    // forks on other threads count into their own profile, merged into
+    // root's after each level (only with profile=1)
+    machine const root(ops);
+    vector<explorer> frontier = {{STARTING_POS, root.fork()}};
+    for (auto level = 1; !frontier.empty(); level++) {
+        vector<vector<discovery>> found(frontier.size());
+        parallel_for(frontier.size(), [&](size_t i) {
+            auto &e = frontier[i];
+            for (int dir = NORTH; dir <= EAST; dir++) {
+                auto next = e.at + STEP[size_t(dir)];
+                if (tiles[next] != dense_grid::UNKNOWN)
+                    continue;
+                auto droid = e.droid.fork_detached();
+                droid.input_.push_back(dir);
+                droid.run();
+                if (droid.output_.size() != 1) {
+                    cerr << "Expected single status value!\n";
+                    throw "!";
+                }
+                auto status = droid.output_.front();
+                droid.output_.pop_front();
+                found[i].push_back({next, status, move(droid)});
             }
-            auto parent_coord = parent.at(droid);
-            if (next = {droid.x + 1, droid.y}; next == parent_coord)
-                input = {EAST};
-            else if (next = {droid.x, droid.y - 1}; next == parent_coord)
-                input = {NORTH};
-            else if (next = {droid.x - 1, droid.y}; next == parent_coord)
-                input = {WEST};
-            else if (next = {droid.x, droid.y + 1}; next == parent_coord)
-                input = {SOUTH};
-            else
-                throw "No parent found!";
-            cout << "backtracking to " << next << "\n";
-        }
-        auto r = m.run_code(input);
-        if (r.size() > 1) {
-            cerr << "Expected single status value!";
-            throw "!";
-        }
-        if (r[0] == HIT_WALL) {
-            tiles[next] = '#';
-            continue;
-        }
-        if (vertices.find(next) == vertices.end()) {
-            // new vertex discovered
-            g.add_vertex();
-            vertices[next] = i_vertex;
-            i_vertex++;
-            g.add_adjacency(vertices.at(droid), vertices.at(next));
-            cout << droid << "->" << next << "\n";
-            parent[next] = droid;
-            tiles[next] = '.';
-            if (r[0] == TARGET_FOUND) {
-                cout << "FOUND TARGET VERTEX " << vertices.at(droid) << "\n";
-                target = droid;
+        });
+        vector<explorer> next_frontier;
+        for (auto &f : found)
+            for (auto &d : f) {
+                root.join_profile(d.droid);
+                if (tiles[d.at] != dense_grid::UNKNOWN)
+                    continue; // found from two sides
+                if (d.status == HIT_WALL) {
+                    tiles.set(d.at, dense_grid::WALL);
+                    continue;
+                }
+                tiles.set(d.at, d.status == TARGET_FOUND ? dense_grid::OXYGEN
+                                                         : dense_grid::OPEN);
+                if (d.status == TARGET_FOUND && !target) {
+                    cout << "FOUND TARGET AT " << d.at << "\n";
+                    target = d.at, target_distance = level;
+                }
+                next_frontier.push_back({d.at, move(d.droid)});
             }
-        }
-        droid = next;
+        frontier = move(next_frontier);
         if (DISPLAY) {
-            display_tiles(tiles, droid);
+            display_tiles(tiles, STARTING_POS);
             this_thread::sleep_for(chrono::milliseconds(100));
         }
     }
-    bfs movement(g);
-    auto path = *movement.path(vertices.at(STARTING_POS), vertices.at(target));
-    auto path_edges = path.size();
-    for (auto &v : path) {
-        auto tile =
-            r::find_if(vertices, [v](auto &x) { return x.second == v; })->first;
-        tiles[tile] = 'X';
+    if (!target) {
+        cerr << "no oxygen system found\n";
+        return 1;
     }
-    display_tiles(tiles, droid);
-    cout << "Length: " << path_edges << "\n";
-    auto max_length = 0;
-    for (auto &[c, v] : vertices) {
-        auto length = bfs(g).path(vertices.at(target), v)->size();
-        if (length > max_length) {
-            max_length = length;
-            cout << length << " ";
-        }
+
+    // mark the shortest path, walking downhill from the start
+    auto to_target = tiles.distances({*target});
+    for (auto p = STARTING_POS; !(p == *target);) {
+        for (int dir = NORTH; dir <= EAST; dir++)
+            if (auto q = p + STEP[size_t(dir)];
+                tiles.distance(to_target, q) ==
+                tiles.distance(to_target, p) - 1) {
+                p = q;
+                break;
+            }
+        if (!(p == *target))
+            tiles.set(p, 'X');
     }
-    cout << "Time to fill: " << max_length << "\n";
+    display_tiles(tiles, STARTING_POS);
+    cout << "Length: " << target_distance << "\n";
+    cout << "Time to fill: "
+         << *max_element(to_target.begin(), to_target.end()) << "\n";
 }
@@ -1,216 +1,15 @@
 #include "_main.hpp"
+#include "_intcode.hpp"
 #include <chrono>
-#include <iterator>
 #include <thread>
 
-enum class opcode : int {
-    add = 1,
-    mul = 2,
-    in = 3,
-    out = 4,
-    jnz = 5,
-    jz = 6,
-    lt = 7,
-    eq = 8,
-    crel = 9,
-    halt = 99,
-};
-
-using memory = vector<ssize_t>;
-using mem_val = memory::value_type;
-using mem_index = int;
-using param_modes = string;
-using io_buffer = deque<mem_val>;
-
-class machine {
-    pair<opcode, param_modes> parse_mem(mem_val p);
-
-  public:
-    memory mem;
-    mem_index i_mem = 0;
-    io_buffer input_, output_;
-    int status_ = 0;
-    bool halted_ = false;
-    mem_index relative_offset_ = 0;
-
-    machine(memory p_mem) : mem(p_mem) {}
-    io_buffer run_code(io_buffer input);
-};
-
-class memory_cell {
-    memory &mem_;
-    param_modes const &par_;
-
-    enum modes {
-        position_mode = 0,
-        immediate_mode = 1,
-        relative_mode = 2,
-    };
-
-    modes mode(mem_index j) const {
-        if (par_.size() <= j)
-            return position_mode;
-        else
-            return static_cast<modes>(par_[j] - '0');
-    }
-
-  public:
-    memory_cell(memory &mem, param_modes const &par, mem_index base,
-                mem_index const &offset)
-        : mem_(mem), par_(par), base_(base), offset_(offset) {}
-
-    mem_index const base_;
-    mem_index const offset_;
-
-    mem_val &operator[](mem_index j) {
-        if (base_ + j >= mem_index(mem_.size()))
-            mem_.resize(base_ + j + 1, 0);
-        auto &val = mem_.at(base_ + j);
-        // cout << "mem at " << base_ << "+" << j << " = " << val << "\n";
-        switch (mode(j)) {
-        case position_mode:
-            if (val >= mem_index(mem_.size())) {
-                mem_.resize(val + 1); // invalidates references!
-                val = mem_.at(base_ + j);
-            }
-            return mem_.at(val);
-        case immediate_mode:
-            return val;
-        case relative_mode: {
-            auto rel = offset_ + val;
-            if (rel >= mem_index(mem_.size()))
-                mem_.resize(rel + 1);
-            return mem_.at(rel);
-        }
-        default:
-            cerr << "unknown mode " << mode(j) << " in cell " << base_ << "\n";
-            return mem_[-1];
-        }
-    }
-};
-
-class instruction {
-  public:
-    using func = function<mem_index(memory_cell, machine &)>;
-    instruction(func p_action) : action(move(p_action)) {}
-    auto operator()(memory_cell c, machine &m) const {
-        return action(move(c), m);
-    }
-
-  private:
-    func action;
-};
-
-/// instruction map
-const map<opcode, instruction> instr = {
-    {opcode::add, {[](auto c, auto &m) {
-         c[2] = c[0] + c[1];
-         return 4;
-     }}},
-    {opcode::mul, {[](auto c, auto &m) {
-         c[2] = c[0] * c[1];
-         return 4;
-     }}},
-    {opcode::in, {[](auto c, auto &m) {
-         if (!m.input_.empty()) {
-             // cout << "reading input " << m.input_.front() << " into " << c[0]
-             //      << "\n";
-             c[0] = m.input_.front();
-             m.input_.pop_back();
-         } else {
-             // cout << "Input a number: ";
-             // int inp;
-             // cin >> inp;
-             // c[0] = inp;
-             // cout << "Awaiting input\n";
-             m.status_ = 2;
-             return 0;
-         }
-         return 2;
-     }}},
-    {opcode::out, {[](auto c, auto &m) {
-         m.output_.push_back(c[0]);
-         return 2;
-     }}},
-    {opcode::jnz, {[](auto c, auto &m) {
-         if (c[0] != 0) {
-             auto r = static_cast<mem_index>(-c.base_ + c[1] + 1);
-             return r;
-         } else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::jz, {[](auto c, auto &m) {
-         if (c[0] == 0)
-             return static_cast<mem_index>(-c.base_ + c[1] + 1);
-         else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::lt, {[](auto c, auto &m) {
-         c[2] = c[0] < c[1];
-         return 4;
-     }}},
-    {opcode::eq, {[](auto c, auto &m) {
-         c[2] = c[0] == c[1];
-         return 4;
-     }}},
-    {opcode::crel, {[](auto c, auto &m) {
-         m.relative_offset_ += c[0];
-         return 2;
-     }}},
-};
-
-pair<opcode, param_modes> machine::parse_mem(mem_val p) {
-    auto str = to_string(p);
-    string op = {str.back()};
-    if (str.size() > 1)
-        op = str[str.size() - 2] + op;
-    param_modes par;
-    for (auto a : nums(0, max(0, int(str.size()) - 2)))
-        par.push_back(str[a]);
-    r::reverse(par);
-    return {static_cast<opcode>(stoi(op)), par};
-}
-
-io_buffer machine::run_code(io_buffer input) {
-    input_ = move(input);
-    output_ = {};
-    while (i_mem < mem.size()) {
-        auto [op, params] = parse_mem(mem[i_mem]);
-        // cout << "instruction " << mem[i_mem] << " = " << int(op) << " with "
-        //     << params << "\n ";
-        if (op == opcode::halt) {
-            halted_ = true;
-            break;
-        }
-        if (auto a = instr.find(op); a != instr.end())
-            i_mem += a->second(
-                memory_cell(mem, params, i_mem + 1, relative_offset_), *this);
-        else {
-            cerr << i_mem << ": unknown opcode " << int(op) << "\n";
-            break;
-        }
-        if (status_ != 0) {
-            status_ = 0;
-            break;
-        }
-    }
-    return move(output_);
-}
-
 struct coord {
     int x, y;
     bool operator<(coord const &p) const {
-        // if (x < p.x)
-        //    return true;
-        // else if (p.x < x)
-        //    return false;
-        // else if (y < p.y)
-        //    return true;
-        // else
-        //    return false;
         return x < p.x || (x == p.x && y < p.y);
     }
     bool operator==(coord const &p) const { return x == p.x && y == p.y; }
+    coord operator+(coord const &p) const { return {x + p.x, y + p.y}; }
 };
 ostream &operator<<(ostream &o, coord const &p) {
     o << p.x << "," << p.y;
@@ -234,82 +33,233 @@ enum {
     CALL_C = 'C',
 };
 
-map<coord, int> find_intersections(map<coord, char> &tiles) {
-    map<coord, int> intersections;
-    for (auto &[pos, c] : tiles) {
-        if (tiles[{pos.x, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x - 1, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x + 1, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x, pos.y + 1}] == SCAFFOLD &&
-            tiles[{pos.x, pos.y - 1}] == SCAFFOLD)
-            intersections[pos] = pos.x * pos.y;
+/// Clockwise from up, in the order of the robot characters "^>v<"
+coord const HEADINGS[] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+char const ROBOT_CHARS[] = {ROBOT_UP, ROBOT_RIGHT, ROBOT_DOWN, ROBOT_LEFT};
+
+/// The camera image, one string per row; outside of it is empty space
+class camera_view {
+    vector<string> rows_;
+
+  public:
+    /// Parses the image from the start of the camera output
+    camera_view(string_view text) {
+        while (!text.empty() && text[0] != NEW_LINE) {
+            auto eol = min(text.find(NEW_LINE), text.size());
+            rows_.emplace_back(text.substr(0, eol));
+            text.remove_prefix(min(eol + 1, text.size()));
+        }
+    }
+    int height() const { return int(rows_.size()); }
+    int width(int y) const { return int(rows_[size_t(y)].size()); }
+    char at(coord p) const {
+        if (p.y < 0 || p.y >= height() || p.x < 0 || p.x >= width(p.y))
+            return EMPTY;
+        return rows_[size_t(p.y)][size_t(p.x)];
+    }
+    /// Scaffold, or the robot standing on it
+    bool scaffold(coord p) const { return at(p) != EMPTY && at(p) != NEW_LINE; }
+
+    /// Sum of x * y over all scaffold crossings
+    int alignment() const {
+        auto sum = 0;
+        for (auto y = 0; y < height(); y++)
+            for (auto x = 0; x < width(y); x++)
+                if (scaffold({x, y}) &&
+                    all_of(begin(HEADINGS), end(HEADINGS),
+                           [&](coord h) { return scaffold(coord{x, y} + h); }))
+                    sum += x * y;
+        return sum;
     }
 
-    // cout << "Alignments: "
-    //     << r::accumulate(intersections, 0,
-    //                      [](auto acc, auto &x) { return acc + x.second; })
-    //     << "\n";
-    return intersections;
+    /// The moves ("R,8") along the scaffold from the robot to the far end,
+    /// going straight over every crossing. The first move is just "8" if
+    /// the robot starts facing along the scaffold, "R,R,8" if facing away.
+    vector<string> path() const;
+};
+
+vector<string> camera_view::path() const {
+    coord pos = {-1, -1};
+    auto dir = 0;
+    for (auto y = 0; y < height(); y++)
+        for (auto x = 0; x < width(y); x++)
+            if (auto r = find(begin(ROBOT_CHARS), end(ROBOT_CHARS), at({x, y}));
+                r != end(ROBOT_CHARS))
+                pos = {x, y}, dir = int(r - begin(ROBOT_CHARS));
+    if (pos.x < 0) {
+        cerr << "no robot on the camera image\n";
+        throw "no robot";
+    }
+    string const right = {char(TURN_RIGHT), char(COMMA)},
+                 left = {char(TURN_LEFT), char(COMMA)};
+    vector<string> moves;
+    for (;;) {
+        // the robot may start facing along the scaffold (no turn) or away
+        // from it (turning twice); after that it always has to turn
+        string turn;
+        if (moves.empty() && scaffold(pos + HEADINGS[dir]))
+            turn = "";
+        else if (scaffold(pos + HEADINGS[(dir + 1) % 4]))
+            turn = right, dir = (dir + 1) % 4;
+        else if (scaffold(pos + HEADINGS[(dir + 3) % 4]))
+            turn = left, dir = (dir + 3) % 4;
+        else if (moves.empty() && scaffold(pos + HEADINGS[(dir + 2) % 4]))
+            turn = right + right, dir = (dir + 2) % 4;
+        else
+            break;
+        auto steps = 0;
+        for (; scaffold(pos + HEADINGS[dir]); steps++)
+            pos = pos + HEADINGS[dir];
+        moves.push_back(turn + to_string(steps));
+    }
+    if (moves.empty()) {
+        cerr << "no scaffold next to the robot\n";
+        throw "no path";
+    }
+    return moves;
 }
 
-void print_alignments(map<coord, char> &tiles, io_buffer output) {
-    coord drawing_pos = {0, 0};
-    for (auto &c : output) {
-        if (c == NEW_LINE) {
-            drawing_pos.x = 0, drawing_pos.y++;
-            continue;
+/**
+ * Splits a path into a main routine calling up to three movement functions
+ * A, B and C, every line at most 20 characters.
+ *
+ * Depth-first over the path: at each position, either call a function that
+ * matches there, or define the next unused function as the moves starting
+ * there (only lengths that fit in 20 characters). The first function
+ * defined is always A, and so on, so no solution is found twice. Failed
+ * states (position, the functions so far) are remembered with the fewest
+ * calls they failed with, as having made more calls cannot help.
+ */
+class movement_compressor {
+  public:
+    static size_t const MAX_LINE = 20;
+    /// Calls "A,B,..." that fit in a line
+    static size_t const MAX_CALLS = (MAX_LINE + 1) / 2;
+
+    movement_compressor(vector<string> moves) : moves_(move(moves)) {}
+
+    /// The main routine and the three functions, if there is a split
+    optional<array<string, 4>> solve();
+
+  private:
+    /// moves [first, first + length) of the path; length 0 if unused
+    struct span {
+        size_t first = 0, length = 0;
+        bool operator<(span const &s) const {
+            return tie(first, length) < tie(s.first, s.length);
         }
-        tiles[drawing_pos] = char(c);
-        drawing_pos.x++;
+    };
+    using functions = array<span, 3>;
+
+    vector<string> moves_;
+    functions functions_;
+    vector<int> calls_;
+    map<pair<size_t, functions>, size_t> dead_;
+
+    bool matches(span f, size_t at) const {
+        return at + f.length <= moves_.size() &&
+               equal(moves_.begin() + ptrdiff_t(f.first),
+                     moves_.begin() + ptrdiff_t(f.first + f.length),
+                     moves_.begin() + ptrdiff_t(at));
+    }
+    bool search(size_t at);
+    string line(span f) const {
+        string r;
+        for (auto i = f.first; i < f.first + f.length; i++)
+            r += (r.empty() ? "" : ",") + moves_[i];
+        return r;
     }
+};
 
-    coord bottom_right = drawing_pos;
-    cout << bottom_right << "\n";
-    auto intersections = find_intersections(tiles);
-    if (true)
-        for (auto y : nums(0, bottom_right.y)) {
-            for (auto x : nums(0, bottom_right.y))
-                if (intersections.find({x, y}) == intersections.end())
-                    cout << tiles[{x, y}];
-                else
-                    cout << "O";
-            cout << "\n";
+bool movement_compressor::search(size_t at) {
+    if (at == moves_.size())
+        return true;
+    if (calls_.size() == MAX_CALLS)
+        return false;
+    auto key = pair(at, functions_);
+    if (auto d = dead_.find(key);
+        d != dead_.end() && d->second <= calls_.size())
+        return false;
+    for (auto f = 0; f < 3; f++) {
+        auto &fn = functions_[size_t(f)];
+        calls_.push_back(f);
+        if (fn.length > 0) {
+            if (matches(fn, at) && search(at + fn.length))
+                return true;
+        } else {
+            // define the first unused function, longest first
+            size_t n = 0;
+            for (size_t chars = 0; at + n < moves_.size(); n++) {
+                chars += moves_[at + n].size() + (n > 0);
+                if (chars > MAX_LINE)
+                    break;
+            }
+            for (; n > 0; n--) {
+                fn = {at, n};
+                if (search(at + n))
+                    return true;
+            }
+            fn = {};
+            calls_.pop_back();
+            break;
         }
+        calls_.pop_back();
+    }
+    auto &d = dead_[key];
+    d = d == 0 ? calls_.size() : min(d, calls_.size());
+    return false;
+}
+
+optional<array<string, 4>> movement_compressor::solve() {
+    functions_ = {}, calls_.clear(), dead_.clear();
+    if (!search(0))
+        return nullopt;
+    array<string, 4> r;
+    for (auto f : calls_)
+        r[0] += (r[0].empty() ? "" : ",") + string(1, char(CALL_A + f));
+    for (size_t f = 0; f < 3; f++)
+        // an unused function still needs a (harmless) definition
+        r[f + 1] = functions_[f].length > 0 ? line(functions_[f]) : "L";
+    return r;
 }
 
 int main(int argc, char **argv) {
     if (argc < 2)
         return 99;
-    ifstream in(argv[1]);
-    memory ops;
-    for (mem_val a = 0; in >> a;) {
-        ops.push_back(a);
-        in.ignore();
-    }
-    enum { NORTH = 1, SOUTH = 2, WEST = 3, EAST = 4 };
+    auto ops = load_program(argv[1]);
 
     bool DISPLAY = argc >= 3 && argv[2] == string("-d");
     ops[0] = 2; // control robot
     machine m(ops);
-    map<coord, char> tiles;
-    string input_code = R"code(A,B,A,C,B,C,A,B,A,C
-R,6,L,10,R,8,R,8
-R,12,L,8,L,10
-R,12,L,10,R,6,L,10
-n
-)code";
-    io_buffer input;
-    r::copy(input_code, back_inserter(input));
-    vector<io_buffer> outputs;
-    for (auto i_input : nums(0_s, input.size())) {
-        auto r = m.run_code({input[i_input]});
-        for (auto a : r)
-            cout << char(a);
-        if (i_input == input.size() - 1) {
-            auto num = find(rbegin(r), rend(r), 10);
-            cout << "Dust: ";
-            copy(rbegin(r), num, ostream_iterator<int>(cout, " "));
-            cout << "\n";
-        }
+    ascii_output out;
+    // the camera image comes first, then the robot asks for the routine
+    m.run_ascii(out);
+    camera_view view(out.text);
+    cout << out.text;
+    cout << "Alignment: " << view.alignment() << "\n";
+
+    auto start = chrono::steady_clock::now();
+    auto moves = view.path();
+    auto routine = movement_compressor(moves).solve();
+    auto took = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                start);
+    if (!routine) {
+        cerr << "no movement routine for a path of " << moves.size()
+             << " moves\n";
+        return 1;
+    }
+    cerr << "routine found in " << took.count() << " ms\n";
+    for (auto &line : *routine) {
+        cout << line << "\n";
+        m.send_line(line);
+    }
+    m.send_line(DISPLAY ? "y" : "n");
+    out.clear();
+    m.run_ascii(out);
+    cout << out.text;
+    if (!out.value) {
+        cerr << "robot reported no dust\n";
+        return 1;
     }
+    cout << "Dust: " << *out.value << "\n";
 }
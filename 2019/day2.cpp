@@ -1,65 +1,52 @@
 #include "_main.hpp"
+#include "_intcode.hpp"
+#include "_intcode_symbolic.hpp"
+#include "_parallel.hpp"
 
-enum class opcode : int {
-    add = 1,
-    mul = 2,
-    halt = 99,
-};
+int const solution = 19690720;
 
-class instruction {
-    function<ssize_t(vector<ssize_t> &, ssize_t)> const action;
-
-  public:
-    instruction(decltype(action) p_action) : action(move(p_action)) {}
-    auto operator()(vector<ssize_t> &a, ssize_t b) { return action(a, b); }
-};
-
-/// instruction map
-map<opcode, instruction> instr = {
-    {opcode::add, {[](auto &c, auto i) {
-         c[c[i + 2]] = c[c[i]] + c[c[i + 1]];
-         return 4;
-     }}},
-    {opcode::mul, {[](auto &c, auto i) {
-         c[c[i + 2]] = c[c[i]] * c[c[i + 1]];
-         return 4;
-     }}},
-};
-
-vector<ssize_t> run_code(vector<ssize_t> mem) {
-    for (ssize_t i_mem = 0; i_mem < mem.size();) {
-        opcode op = static_cast<opcode>(mem[i_mem]);
-        if (op == opcode::halt)
-            break;
-        if (auto a = instr.find(op); a != instr.end())
-            i_mem += a->second(mem, i_mem + 1);
-        else {
-            cerr << "unknown opcode " << int(op) << "\n";
-            break;
+/**
+ * Brute force over the nouns in parallel, for programs the symbolic machine
+ * cannot close. Each worker rewinds one machine to a snapshot of the program
+ * before every run, which copies back only the words the last run changed.
+ * Nouns above the lowest one found so far are skipped.
+ */
+optional<pair<mem_val, mem_val>> search(memory const &ops) {
+    int const n = 100;
+    auto const start = machine(ops).snapshot();
+    atomic<int> best = n * n;
+    parallel_for(n, [&](size_t noun) {
+        machine m(start);
+        for (int verb = 0; verb < n && int(noun) * n < best; verb++) {
+            m.rewind(start);
+            m.write(1, mem_val(noun)), m.write(2, verb);
+            m.run();
+            if (m.read(0) == solution) {
+                auto found = int(noun) * n + verb;
+                for (auto b = best.load(); found < b;)
+                    best.compare_exchange_weak(b, found);
+                return;
+            }
         }
-    }
-    return move(mem);
+    });
+    if (best == n * n)
+        return nullopt;
+    return pair(best / n, best % n);
 }
 
 int main(int argc, char **argv) {
     if (argc < 2)
         return 99;
-    ifstream in(argv[1]);
-    int const solution = 19690720;
-    vector<ssize_t> ops;
-    for (ssize_t a = 0; in >> a;) {
-        ops.push_back(a);
-        in.ignore();
-    }
-    for (int noun : nums(0, 100)) {
-        for (int verb : nums(0, 100)) {
-            ops[1] = noun;
-            ops[2] = verb;
-            auto r = run_code(ops);
-            if (r[0] == solution) {
-                cout << (100 * r[1] + r[2]) << "\n";
-                return 0;
-            }
-        }
-    }
+    auto ops = load_program(argv[1]);
+    // -b searches by brute force even if there is a closed form
+    bool BRUTE_FORCE = argc >= 3 && argv[2] == string("-b");
+    // mem[0] as a closed form in noun (x0) and verb (x1), if the program
+    // allows it
+    symbolic_machine symbolic(ops, {1, 2});
+    auto closed =
+        !BRUTE_FORCE && symbolic.run() && symbolic.read(0).known();
+    auto found = closed ? solve_two(symbolic.read(0), solution, 100)
+                        : search(ops);
+    if (found)
+        cout << (100 * found->first + found->second) << "\n";
 }
@@ -1,327 +1,556 @@
 #include "_main.hpp"
-#include <chrono>
-#include <iterator>
-#include <thread>
-
-enum class opcode : int {
-    add = 1,
-    mul = 2,
-    in = 3,
-    out = 4,
-    jnz = 5,
-    jz = 6,
-    lt = 7,
-    eq = 8,
-    crel = 9,
-    halt = 99,
-};
+#include "_intcode.hpp"
+#include "_parallel.hpp"
+#include <variant>
 
-using memory = vector<ssize_t>;
-using mem_val = memory::value_type;
-using mem_index = int;
-using param_modes = string;
-using io_buffer = deque<mem_val>;
+enum { HOLE = '.', GROUND = '#', DROID = '@' };
 
-class machine {
-    pair<opcode, param_modes> parse_mem(mem_val p);
+/// Sensor readings A, B, ... as bits 0, 1, ... (set: ground)
+using situation = unsigned;
 
-  public:
-    memory mem;
-    mem_index i_mem = 0;
-    io_buffer input_, output_;
-    int status_ = 0;
-    bool halted_ = false;
-    mem_index relative_offset_ = 0;
-
-    machine(memory p_mem) : mem(p_mem) {}
-    io_buffer run_code(io_buffer input);
-};
+/**
+ * Whether every way on from a situation runs into a hole the sensors show:
+ * no program that crosses ever gets there, so what it does there does not
+ * matter
+ */
+bool doomed(situation s, int n_sensors) {
+    auto ground = [&](int k) { return k > n_sensors || (s >> (k - 1)) & 1; };
+    // safe[q]: the droid q cells ahead could go on, as far as it can see
+    vector<bool> safe(size_t(n_sensors) + 5, true);
+    for (auto q = n_sensors - 1; q >= 0; q--)
+        safe[size_t(q)] = (ground(q + 1) && safe[size_t(q) + 1]) ||
+                          (ground(q + 4) && safe[size_t(q) + 4]);
+    return !safe[0];
+}
 
-class memory_cell {
-    memory &mem_;
-    param_modes const &par_;
+enum class spring_op { AND, OR, NOT };
 
-    enum modes {
-        position_mode = 0,
-        immediate_mode = 1,
-        relative_mode = 2,
-    };
+/// One springscript instruction; registers 0 .. n_sensors - 1 are the
+/// sensors, then T and J
+struct spring_instr {
+    spring_op op;
+    int src, dst;
+};
 
-    modes mode(mem_index j) const {
-        if (par_.size() <= j)
-            return position_mode;
-        else
-            return static_cast<modes>(par_[j] - '0');
-    }
+/**
+ * Whether a program ending in last needs no i appended, since other
+ * programs of the same length or shorter reach the same registers: i
+ * commutes with last but comes first in a fixed order, or i is a NOT that
+ * overwrites what last just wrote without reading it. By induction over the
+ * length, every state is still reached at its shortest length.
+ */
+bool redundant(spring_instr last, spring_instr i) {
+    if (i.op == spring_op::NOT && i.dst == last.dst && i.src != last.dst)
+        return true;
+    auto independent = i.dst != last.dst && i.src != last.dst &&
+                       last.src != i.dst;
+    return independent && tuple(i.dst, i.op, i.src) <
+                              tuple(last.dst, last.op, last.src);
+}
+
+/// Open-addressing set of indices (of states stored elsewhere); keeping the
+/// hashes next to them saves most comparisons of the states themselves
+template <class Hash, class Equal> class index_set {
+    /// hash, index + 1 (0: empty slot)
+    vector<pair<size_t, size_t>> slots_;
+    size_t size_ = 0;
+    Hash hash_;
+    Equal equal_;
 
   public:
-    memory_cell(memory &mem, param_modes const &par, mem_index base,
-                mem_index const &offset)
-        : mem_(mem), par_(par), base_(base), offset_(offset) {}
-
-    mem_index const base_;
-    mem_index const offset_;
-
-    mem_val &operator[](mem_index j) {
-        if (base_ + j >= mem_index(mem_.size()))
-            mem_.resize(base_ + j + 1, 0);
-        auto &val = mem_.at(base_ + j);
-        // cout << "mem at " << base_ << "+" << j << " = " << val << "\n";
-        switch (mode(j)) {
-        case position_mode:
-            if (val >= mem_index(mem_.size())) {
-                mem_.resize(val + 1); // invalidates references!
-                val = mem_.at(base_ + j);
+    index_set(Hash hash, Equal equal)
+        : slots_(1024), hash_(hash), equal_(equal) {}
+
+    /// Adds n unless an equal index is in the set already
+    bool insert(size_t n) {
+        if (2 * (size_ + 1) > slots_.size()) {
+            vector<pair<size_t, size_t>> old(2 * slots_.size());
+            swap(old, slots_);
+            for (auto &s : old)
+                if (s.second)
+                    place(s);
+        }
+        auto h = hash_(n);
+        auto mask = slots_.size() - 1;
+        for (auto i = h & mask;; i = (i + 1) & mask) {
+            if (!slots_[i].second) {
+                slots_[i] = {h, n + 1}, size_++;
+                return true;
             }
-            return mem_.at(val);
-        case immediate_mode:
-            return val;
-        case relative_mode: {
-            auto rel = offset_ + val;
-            if (rel >= mem_index(mem_.size()))
-                mem_.resize(rel + 1);
-            return mem_.at(rel);
+            if (slots_[i].first == h && equal_(slots_[i].second - 1, n))
+                return false;
+        }
+    }
+
+  private:
+    void place(pair<size_t, size_t> s) {
+        auto mask = slots_.size() - 1;
+        auto i = s.first & mask;
+        while (slots_[i].second)
+            i = (i + 1) & mask;
+        slots_[i] = s;
+    }
+};
+
+/// A hash of count words from w
+size_t hash_words(uint64_t const *w, size_t count) {
+    size_t h = 0;
+    for (size_t k = 0; k < count; k++)
+        h = (h ^ w[k]) * 0x9e3779b97f4a7c15 + (h >> 29);
+    return h;
+}
+
+/// Distinct tables of n_words words each
+class table_set {
+    struct hash {
+        table_set const *s;
+        size_t operator()(size_t k) const {
+            return hash_words(&s->tables_[k * s->n_words_], s->n_words_);
         }
-        default:
-            cerr << "unknown mode " << mode(j) << " in cell " << base_ << "\n";
-            return mem_[-1];
+    };
+    struct same {
+        table_set const *s;
+        bool operator()(size_t a, size_t b) const {
+            auto t = s->tables_.begin();
+            auto n = ptrdiff_t(s->n_words_);
+            return equal(t + ptrdiff_t(a) * n, t + ptrdiff_t(a + 1) * n,
+                         t + ptrdiff_t(b) * n);
         }
+    };
+    vector<uint64_t> tables_;
+    size_t n_words_;
+    index_set<hash, same> set_;
+
+  public:
+    explicit table_set(size_t n_words)
+        : n_words_(n_words), set_(hash{this}, same{this}) {}
+    table_set(table_set const &) = delete;
+
+    /// Adds the table at t; false if it was in the set already
+    bool insert(uint64_t const *t) {
+        tables_.insert(tables_.end(), t, t + n_words_);
+        if (set_.insert(tables_.size() / n_words_ - 1))
+            return true;
+        tables_.resize(tables_.size() - n_words_);
+        return false;
     }
 };
 
-class instruction {
+/**
+ * Finds a springscript program that gets the droid across, by
+ * counterexample-guided synthesis.
+ *
+ * Every failed run shows the hull the droid fell on; all hulls so far are
+ * kept as counterexamples. Programs are enumerated bottom-up by length
+ * (breadth-first) as the truth tables they leave in T and J, restricted to
+ * the sensor situations occurring on those hulls (but the doomed ones):
+ * programs computing the same tables there are equivalent and only the
+ * shortest is kept. The shortest programs whose J gets the droid across
+ * every known hull (checked by simulating the jumps) are run on the real
+ * droid, in parallel, each on a machine restored from a snapshot taken at
+ * the "Input instructions:" prompt. The hulls of those that fail are added,
+ * and the search starts over.
+ */
+class springscript_synth {
   public:
-    using func = function<mem_index(memory_cell, machine &)>;
-    instruction(func p_action) : action(move(p_action)) {}
-    auto operator()(memory_cell c, machine &m) const {
-        return action(move(c), m);
+    static int const MAX_INSTRUCTIONS = 15;
+    /// Programs run on the droid per round
+    static size_t const MAX_CANDIDATES = 64;
+    /// States the enumeration may keep before giving up
+    static size_t const MAX_STATES = 8'000'000;
+
+    struct result {
+        vector<spring_instr> program;
+        mem_val damage;
+        size_t rounds, candidates;
+    };
+
+    /// prompt: the droid waiting for instructions; go: "WALK" or "RUN"
+    springscript_synth(machine_snapshot prompt, int n_sensors, string go)
+        : prompt_(move(prompt)), n_sensors_(n_sensors), go_(move(go)) {
+        index_.assign(1u << n_sensors, -1);
     }
 
+    optional<result> solve();
+    string text(spring_instr i) const;
+    vector<string> const &hulls() const { return hulls_; }
+
   private:
-    func action;
-};
+    /// A truth table has one bit per seen situation, in words of 64
+    using word = uint64_t;
 
-/// instruction map
-const map<opcode, instruction> instr = {
-    {opcode::add, {[](auto c, auto &m) {
-         c[2] = c[0] + c[1];
-         return 4;
-     }}},
-    {opcode::mul, {[](auto c, auto &m) {
-         c[2] = c[0] * c[1];
-         return 4;
-     }}},
-    {opcode::in, {[](auto c, auto &m) {
-         if (!m.input_.empty()) {
-             // cout << "reading input " << m.input_.front() << " into " << c[0]
-             //      << "\n";
-             c[0] = m.input_.front();
-             m.input_.pop_back();
-         } else {
-             // cout << "Input a number: ";
-             // int inp;
-             // cin >> inp;
-             // c[0] = inp;
-             // cout << "Awaiting input\n";
-             m.status_ = 2;
-             return 0;
-         }
-         return 2;
-     }}},
-    {opcode::out, {[](auto c, auto &m) {
-         m.output_.push_back(c[0]);
-         return 2;
-     }}},
-    {opcode::jnz, {[](auto c, auto &m) {
-         if (c[0] != 0) {
-             auto r = static_cast<mem_index>(-c.base_ + c[1] + 1);
-             return r;
-         } else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::jz, {[](auto c, auto &m) {
-         if (c[0] == 0)
-             return static_cast<mem_index>(-c.base_ + c[1] + 1);
-         else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::lt, {[](auto c, auto &m) {
-         c[2] = c[0] < c[1];
-         return 4;
-     }}},
-    {opcode::eq, {[](auto c, auto &m) {
-         c[2] = c[0] == c[1];
-         return 4;
-     }}},
-    {opcode::crel, {[](auto c, auto &m) {
-         m.relative_offset_ += c[0];
-         return 2;
-     }}},
+    machine_snapshot const prompt_;
+    int const n_sensors_;
+    string const go_;
+    vector<string> hulls_;
+    /// the situations occurring on any hull, and their index there (or -1)
+    vector<situation> seen_;
+    vector<int> index_;
+    /// per hull and position, the index of what the droid senses there (-1
+    /// on holes and where it is doomed)
+    vector<vector<int>> senses_;
+
+    bool add_hull(string hull);
+    bool crosses(word const *jump, size_t h) const;
+    vector<vector<spring_instr>> search() const;
+    /// Runs a program on the droid: the damage, or the hull it fell on
+    variant<mem_val, string> run(vector<spring_instr> const &program) const;
 };
 
-pair<opcode, param_modes> machine::parse_mem(mem_val p) {
-    auto str = to_string(p);
-    string op = {str.back()};
-    if (str.size() > 1)
-        op = str[str.size() - 2] + op;
-    param_modes par;
-    for (auto a : nums(0, max(0, int(str.size()) - 2)))
-        par.push_back(str[a]);
-    r::reverse(par);
-    return {static_cast<opcode>(stoi(op)), par};
+string springscript_synth::text(spring_instr i) const {
+    static char const *const ops[] = {"AND", "OR", "NOT"};
+    auto reg = [&](int r) {
+        return r < n_sensors_ ? char('A' + r) : r == n_sensors_ ? 'T' : 'J';
+    };
+    return ops[int(i.op)] + string(" ") + reg(i.src) + " " + reg(i.dst);
 }
 
-io_buffer machine::run_code(io_buffer input) {
-    input_ = move(input);
-    output_ = {};
-    while (i_mem < mem.size()) {
-        auto [op, params] = parse_mem(mem[i_mem]);
-        // cout << "instruction " << mem[i_mem] << " = " << int(op) << " with "
-        //     << params << "\n ";
-        if (op == opcode::halt) {
-            halted_ = true;
-            break;
-        }
-        if (auto a = instr.find(op); a != instr.end())
-            i_mem += a->second(
-                memory_cell(mem, params, i_mem + 1, relative_offset_), *this);
-        else {
-            cerr << i_mem << ": unknown opcode " << int(op) << "\n";
-            break;
-        }
-        if (status_ != 0) {
-            status_ = 0;
-            break;
+/// Adds a counterexample; false if it was known already
+bool springscript_synth::add_hull(string hull) {
+    if (find(hulls_.begin(), hulls_.end(), hull) != hulls_.end())
+        return false;
+    vector<int> senses(hull.size(), -1);
+    for (size_t p = 0; p < hull.size(); p++) {
+        if (hull[p] == HOLE)
+            continue;
+        situation s = 0;
+        for (auto k = 0; k < n_sensors_; k++) {
+            auto at = p + 1 + size_t(k);
+            if (at >= hull.size() || hull[at] != HOLE)
+                s |= 1u << k;
         }
+        if (doomed(s, n_sensors_))
+            continue;
+        if (index_[s] < 0)
+            index_[s] = int(seen_.size()), seen_.push_back(s);
+        senses[p] = index_[s];
     }
-    return move(output_);
+    hulls_.push_back(move(hull));
+    senses_.push_back(move(senses));
+    return true;
 }
 
-struct coord {
-    int x, y;
-    bool operator<(coord const &p) const {
-        // if (x < p.x)
-        //    return true;
-        // else if (p.x < x)
-        //    return false;
-        // else if (y < p.y)
-        //    return true;
-        // else
-        //    return false;
-        return x < p.x || (x == p.x && y < p.y);
+/// Whether the droid, jumping where jump says, gets over hull h
+bool springscript_synth::crosses(word const *jump, size_t h) const {
+    auto &hull = hulls_[h];
+    for (size_t p = 0; p < hull.size();) {
+        auto i = senses_[h][p];
+        p += i >= 0 && (jump[i / 64] >> (i % 64)) & 1 ? 4 : 1;
+        if (p < hull.size() && hull[p] == HOLE)
+            return false;
     }
-    bool operator==(coord const &p) const { return x == p.x && y == p.y; }
-};
-ostream &operator<<(ostream &o, coord const &p) {
-    o << p.x << "," << p.y;
-    return o;
+    return true;
 }
 
-enum {
-    SCAFFOLD = '#',
-    EMPTY = '.',
-    ROBOT_UP = '^',
-    ROBOT_DOWN = 'v',
-    ROBOT_LEFT = '<',
-    ROBOT_RIGHT = '>',
-    ROBOT_DANGER = 'X',
-    NEW_LINE = 10,
-    COMMA = ',',
-    TURN_RIGHT = 'R',
-    TURN_LEFT = 'L',
-    CALL_A = 'A',
-    CALL_B = 'B',
-    CALL_C = 'C',
-};
+/**
+ * The shortest programs crossing all known hulls. States (the tables of T
+ * and J) are stored level by level, but the goal is checked two
+ * instructions ahead of the last stored level: the second of those must
+ * write J, so the level in between is never stored, and its states are
+ * only kept long enough to try the instructions that write J.
+ */
+vector<vector<spring_instr>> springscript_synth::search() const {
+    auto n_words = max(1_s, (seen_.size() + 63) / 64);
+    auto last_mask = seen_.size() % 64 == 0
+                         ? ~word(0)
+                         : (word(1) << (seen_.size() % 64)) - 1;
+    // registers as tables: the sensors, then (per state) T and J
+    vector<word> sensors(size_t(n_sensors_) * n_words);
+    for (size_t i = 0; i < seen_.size(); i++)
+        for (auto k = 0; k < n_sensors_; k++)
+            if ((seen_[i] >> k) & 1)
+                sensors[size_t(k) * n_words + i / 64] |= word(1) << (i % 64);
+    // hard: the hull that failed last, most likely to fail again
+    auto goal = [&](word const *jump, size_t &hard) {
+        if (hard < hulls_.size() && !crosses(jump, hard))
+            return false;
+        for (size_t h = 0; h < hulls_.size(); h++)
+            if (h != hard && !crosses(jump, h)) {
+                hard = h;
+                return false;
+            }
+        return true;
+    };
 
-map<coord, int> find_intersections(map<coord, char> &tiles) {
-    map<coord, int> intersections;
-    for (auto &[pos, c] : tiles) {
-        if (tiles[{pos.x, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x - 1, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x + 1, pos.y}] == SCAFFOLD &&
-            tiles[{pos.x, pos.y + 1}] == SCAFFOLD &&
-            tiles[{pos.x, pos.y - 1}] == SCAFFOLD)
-            intersections[pos] = pos.x * pos.y;
-    }
+    // state n: T in tables[2n * n_words, ...), J right after it
+    vector<word> tables(2 * n_words);
+    vector<pair<int, spring_instr>> from = {{-1, {}}};
+    auto words = [&](size_t n, int reg) {
+        return tables.begin() + ptrdiff_t((2 * n + size_t(reg)) * n_words);
+    };
+    auto hash_state = [&](size_t n) {
+        return hash_words(&*words(n, 0), 2 * n_words);
+    };
+    auto same_state = [&](size_t a, size_t b) {
+        return equal(words(a, 0), words(a, 2), words(b, 0));
+    };
+    index_set states(hash_state, same_state);
+    states.insert(0);
 
-    // cout << "Alignments: "
-    //     << r::accumulate(intersections, 0,
-    //                      [](auto acc, auto &x) { return acc + x.second; })
-    //     << "\n";
-    return intersections;
-}
+    // instruction i on the registers at state (T, then J), in place
+    auto step = [&](word *state, spring_instr i) {
+        auto x = i.src < n_sensors_
+                     ? &sensors[size_t(i.src) * n_words]
+                     : state + (i.src == n_sensors_ ? 0 : n_words);
+        auto y = state + (i.dst == n_sensors_ ? 0 : n_words);
+        for (size_t w = 0; w < n_words; w++)
+            y[w] = i.op == spring_op::AND  ? x[w] & y[w]
+                   : i.op == spring_op::OR ? x[w] | y[w]
+                                           : ~x[w];
+        y[n_words - 1] &= last_mask;
+    };
+    auto apply = [&](size_t n, spring_instr i, word *out) {
+        copy_n(words(n, 0), 2 * n_words, out);
+        step(out, i);
+    };
+    auto program = [&](size_t n, vector<spring_instr> tail) {
+        vector<spring_instr> r;
+        for (auto i = int(n); from[size_t(i)].first >= 0;
+             i = from[size_t(i)].first)
+            r.push_back(from[size_t(i)].second);
+        reverse(r.begin(), r.end());
+        r.insert(r.end(), tail.begin(), tail.end());
+        return r;
+    };
+    auto ops = {spring_op::AND, spring_op::OR, spring_op::NOT};
+    auto j = n_sensors_ + 1;
 
-void print_alignments(map<coord, char> &tiles, io_buffer output) {
-    coord drawing_pos = {0, 0};
-    for (auto &c : output) {
-        if (c == NEW_LINE) {
-            drawing_pos.x = 0, drawing_pos.y++;
-            continue;
+    // the programs of up to one instruction
+    size_t hard = 0;
+    if (goal(&tables[n_words], hard))
+        return {{}};
+    vector<vector<spring_instr>> found;
+    vector<word> child(2 * n_words);
+    for (auto src = 0; src < n_sensors_ + 2; src++)
+        for (auto op : ops)
+            if (apply(0, {op, src, j}, child.data()),
+                goal(&child[n_words], hard))
+                found.push_back({{op, src, j}});
+    if (!found.empty())
+        return found;
+
+    // the instructions that may follow state n
+    vector<spring_instr> instrs;
+    for (auto src = 0; src < n_sensors_ + 2; src++)
+        for (auto op : ops)
+            for (auto dst = n_sensors_; dst <= j; dst++)
+                instrs.push_back({op, src, dst});
+    auto follows = [&](size_t n, spring_instr i) {
+        return n == 0 || !redundant(from[n].second, i);
+    };
+    auto changes = [&](size_t n, word const *state) {
+        return !equal(words(n, 0), words(n, 2), state);
+    };
+    // instruction k and then an op on T into J, with the tables before
+    // them that the J after them depends on: bit 0 for T, bit 1 for J.
+    // Those depending on both come first.
+    struct ending {
+        size_t k;
+        spring_op op;
+        int reads;
+    };
+    vector<ending> endings;
+    for (size_t k = 0; k < instrs.size(); k++)
+        for (auto op2 : ops) {
+            auto i1 = instrs[k];
+            spring_instr i2 = {op2, n_sensors_, j};
+            // AND and OR into J commute: the order writing from T first is
+            // tried after the new Js
+            if (redundant(i1, i2) ||
+                (i1.dst == j && i1.op == op2 && op2 != spring_op::NOT &&
+                 i1.src != n_sensors_))
+                continue;
+            int r[] = {1, 2};
+            for (auto i : {i1, i2}) {
+                auto x = i.src < n_sensors_ ? 0 : r[i.src - n_sensors_];
+                auto &y = r[i.dst - n_sensors_];
+                y = i.op == spring_op::NOT ? x : x | y;
+            }
+            endings.push_back({k, op2, r[1]});
+        }
+    auto n_both = size_t(
+        stable_partition(endings.begin(), endings.end(),
+                         [](ending const &e) { return e.reads == 3; }) -
+        endings.begin());
+
+    for (size_t first = 0, length = 2;; length++) {
+        auto last = from.size();
+        // writing J and then J again from a sensor or J gives a table that
+        // only depends on the first J written, so those are tried once per
+        // distinct table, from the first state and instruction writing it.
+        // Unless it reads T, that first J only depends on the J before, so
+        // those instructions are tried once per distinct J before (all of
+        // them, whatever the state they follow). fresh: whether a state has
+        // the first T (bit 0) and J (bit 1) of its level.
+        table_set mid_js(n_words), before_ts(n_words), before_js(n_words);
+        vector<pair<size_t, spring_instr>> new_js;
+        vector<int> fresh(last - first);
+        vector<word> mid(2 * n_words);
+        for (auto n = first; n < last; n++) {
+            auto new_j = before_js.insert(&*words(n, 1));
+            fresh[n - first] = before_ts.insert(&*words(n, 0)) | new_j << 1;
+            for (auto &i : instrs)
+                if (i.dst == j &&
+                    (i.src == n_sensors_ ? follows(n, i) : new_j) &&
+                    (apply(n, i, mid.data()), changes(n, mid.data())) &&
+                    mid_js.insert(&mid[n_words]))
+                    new_js.push_back({n, i});
         }
-        tiles[drawing_pos] = char(c);
-        drawing_pos.x++;
-    }
 
-    coord bottom_right = drawing_pos;
-    cout << bottom_right << "\n";
-    auto intersections = find_intersections(tiles);
-    if (true)
-        for (auto y : nums(0, bottom_right.y)) {
-            for (auto x : nums(0, bottom_right.y))
-                if (intersections.find({x, y}) == intersections.end())
-                    cout << tiles[{x, y}];
+        // the goal checks run in parallel: first the J writes reading T
+        // after each state, then the others after each new J. As above, a J
+        // that only depends on one table before is tried once per distinct
+        // table, and one depending on neither only after the empty program.
+        // Every chunk keeps its first finds, so the result does not depend
+        // on the number of threads.
+        size_t const chunk = 4096;
+        auto state_chunks = (last - first + chunk - 1) / chunk;
+        vector<vector<vector<spring_instr>>> chunk_found(
+            state_chunks + (new_js.size() + chunk - 1) / chunk);
+        parallel_for(chunk_found.size(), [&](size_t c) {
+            vector<word> mid(2 * n_words), end(2 * n_words);
+            auto &mine = chunk_found[c];
+            size_t hard = 0;
+            auto ends = [&](size_t n, spring_instr i1, spring_instr i2) {
+                if (redundant(i1, i2) || mine.size() >= MAX_CANDIDATES)
+                    return;
+                copy_n(mid.begin(), 2 * n_words, end.begin());
+                step(end.data(), i2);
+                if (goal(&end[n_words], hard))
+                    mine.push_back(program(n, {i1, i2}));
+            };
+            if (c < state_chunks) {
+                for (auto n = first + c * chunk;
+                     n < min(last, first + (c + 1) * chunk); n++) {
+                    auto f = fresh[n - first];
+                    auto applied = instrs.size();
+                    auto useful = false;
+                    for (size_t e = 0; e < (f ? endings.size() : n_both);
+                         e++) {
+                        auto [k, op2, r] = endings[e];
+                        auto i1 = instrs[k];
+                        if (r == 3 ? !follows(n, i1)
+                                   : (r & ~f) || (r == 0 && n > 0))
+                            continue;
+                        if (applied != k) {
+                            apply(n, i1, mid.data());
+                            applied = k, useful = changes(n, mid.data());
+                        }
+                        if (useful)
+                            ends(n, i1, {op2, n_sensors_, j});
+                    }
+                }
+                return;
+            }
+            auto k0 = (c - state_chunks) * chunk;
+            for (auto k = k0; k < min(new_js.size(), k0 + chunk); k++) {
+                auto [n, i1] = new_js[k];
+                apply(n, i1, mid.data());
+                for (auto src2 = 0; src2 < n_sensors_ + 2; src2++)
+                    if (src2 != n_sensors_)
+                        for (auto op2 : ops)
+                            ends(n, i1, {op2, src2, j});
+            }
+        });
+        for (auto &f : chunk_found)
+            for (auto &p : f)
+                if (found.size() < MAX_CANDIDATES)
+                    found.push_back(move(p));
+        if (!found.empty() || length == MAX_INSTRUCTIONS ||
+            from.size() > MAX_STATES)
+            return found;
+
+        for (auto n = first; n < last; n++)
+            for (auto &i : instrs) {
+                if (!follows(n, i))
+                    continue;
+                tables.resize(tables.size() + 2 * n_words);
+                apply(n, i, &tables[tables.size() - 2 * n_words]);
+                if (!same_state(n, from.size()) && states.insert(from.size()))
+                    from.push_back({int(n), i});
                 else
-                    cout << "O";
-            cout << "\n";
+                    tables.resize(tables.size() - 2 * n_words);
+            }
+        first = last;
+    }
+}
+
+variant<mem_val, string>
+springscript_synth::run(vector<spring_instr> const &program) const {
+    machine m(prompt_);
+    for (auto &i : program)
+        m.send_line(text(i));
+    m.send_line(go_);
+    ascii_output out;
+    m.run_ascii(out);
+    if (out.value)
+        return *out.value;
+    // the first frame after the message shows the whole hull
+    istringstream lines(out.text.substr(min(
+        out.text.find("Didn't make it across"), out.text.size())));
+    for (string line; getline(lines, line);)
+        if (!line.empty() && line[0] == GROUND) {
+            replace(line.begin(), line.end(), char(DROID), char(GROUND));
+            return line;
+        }
+    cerr << "unexpected droid output:\n" << out.text;
+    throw "droid neither crossed nor fell";
+}
+
+optional<springscript_synth::result> springscript_synth::solve() {
+    size_t candidates = 0;
+    for (size_t round = 1;; round++) {
+        auto programs = search();
+        if (programs.empty())
+            return nullopt;
+        vector<variant<mem_val, string>> runs(programs.size());
+        parallel_for(programs.size(),
+                     [&](size_t i) { runs[i] = run(programs[i]); });
+        candidates += programs.size();
+        for (size_t i = 0; i < programs.size(); i++)
+            if (auto damage = get_if<mem_val>(&runs[i]))
+                return result{programs[i], *damage, round, candidates};
+        auto learned = false;
+        for (auto &r : runs)
+            learned |= add_hull(get<string>(r));
+        if (!learned) {
+            cerr << "the droid fell on a hull it should have crossed\n";
+            throw "springscript simulation is wrong";
         }
+    }
 }
 
 int main(int argc, char **argv) {
     if (argc < 2)
         return 99;
-    ifstream in(argv[1]);
-    memory ops;
-    for (mem_val a = 0; in >> a;) {
-        ops.push_back(a);
-        in.ignore();
-    }
-    enum { NORTH = 1, SOUTH = 2, WEST = 3, EAST = 4 };
+    auto ops = load_program(argv[1]);
 
     bool DISPLAY = argc >= 3 && argv[2] == string("-d");
     machine m(ops);
-    map<coord, char> tiles;
-    string input_code1 = R"code(OR A T
-OR B T
-OR C T
-NOT T J
-NOT C T
-AND D T
-OR T J
-NOT A T
-AND D T
-OR T J
-WALK
-)code";
-    string input_code = R"code(OR B T
-AND C T
-NOT T T
-AND D T
-AND H T
-OR T J
-NOT A T
-OR T J
-RUN
-    )code";
-    io_buffer input;
-    r::copy(input_code, back_inserter(input));
-    vector<long> outputs;
-    for (auto i_input : nums(0_s, input.size())) {
-        auto r = m.run_code({input[i_input]});
-        for (auto a : r)
-            outputs.push_back(a);
+    ascii_output out;
+    m.run_ascii(out);
+    auto prompt = m.snapshot();
+
+    for (auto [part, n_sensors, go] :
+         {tuple(1, 4, "WALK"), tuple(2, 9, "RUN")}) {
+        springscript_synth synth(prompt, n_sensors, go);
+        auto r = synth.solve();
+        if (!r) {
+            cerr << "no springscript of at most "
+                 << springscript_synth::MAX_INSTRUCTIONS
+                 << " instructions for part " << part << "\n";
+            return 1;
+        }
+        cout << "Part " << part << ", " << r->program.size()
+             << " instructions (" << r->candidates << " tried in "
+             << r->rounds << " rounds):\n";
+        for (auto &i : r->program)
+            cout << synth.text(i) << "\n";
+        cout << go << "\n";
+        if (DISPLAY)
+            for (auto &hull : synth.hulls())
+                cout << "  counterexample " << hull << "\n";
+        cout << (part == 1 ? "Walk damage: " : "Damage: ") << r->damage
+             << "\n";
     }
-    for (auto a : outputs)
-        cout << char(a);
-    cout << "Damage: " << outputs.back() << "\n";
 }
@@ -1,223 +1,176 @@
 #include "_main.hpp"
+#include "_intcode.hpp"
 #include <chrono>
 #include <iterator>
 #include <thread>
 
-enum class opcode : int {
-    add = 1,
-    mul = 2,
-    in = 3,
-    out = 4,
-    jnz = 5,
-    jz = 6,
-    lt = 7,
-    eq = 8,
-    crel = 9,
-    halt = 99,
+struct coord {
+    int x, y;
+    bool operator<(coord const &p) const {
+        return x < p.x || (x == p.x && y < p.y);
+    }
+    bool operator==(coord const &p) const { return x == p.x && y == p.y; }
 };
+ostream &operator<<(ostream &o, coord const &p) {
+    o << p.x << "," << p.y;
+    return o;
+}
 
-using memory = vector<ssize_t>;
-using mem_val = memory::value_type;
-using mem_index = int;
-using param_modes = string;
-using io_buffer = deque<mem_val>;
-
-class machine {
-    pair<opcode, param_modes> parse_mem(mem_val p);
-
-  public:
-    memory mem;
-    mem_index i_mem = 0;
-    io_buffer input_, output_;
-    int status_ = 0;
-    bool halted_ = false;
-    mem_index relative_offset_ = 0;
-
-    machine(memory p_mem) : mem(p_mem) {}
-    io_buffer run_code(io_buffer input);
+/// What the droid answered to one command
+struct reply {
+    string text;
+    /// false if the game ended, or it kept printing (the infinite loop)
+    bool alive;
 };
 
-class memory_cell {
-    memory &mem_;
-    param_modes const &par_;
+/// Sends a command line (none if empty) and collects the answer
+reply command(machine &m, string_view line) {
+    size_t const max_text = 1 << 14;
+    if (!line.empty())
+        m.send_line(line);
+    ascii_output out;
+    auto why = m.run_ascii(out, max_text);
+    return {move(out.text), why == stop_reason::input};
+}
 
-    enum modes {
-        position_mode = 0,
-        immediate_mode = 1,
-        relative_mode = 2,
-    };
+struct room {
+    string name;
+    vector<string> doors, items;
+};
 
-    modes mode(mem_index j) const {
-        if (par_.size() <= j)
-            return position_mode;
+/// The last room described in text (being thrown out of the security check
+/// describes two rooms)
+optional<room> parse_room(string const &text) {
+    auto at = text.rfind("== ");
+    if (at == string::npos || (at > 0 && text[at - 1] != '\n'))
+        return nullopt;
+    istringstream lines(text.substr(at));
+    room r;
+    string line;
+    getline(lines, line);
+    r.name = line.substr(3, line.size() - 6);
+    vector<string> *list = nullptr;
+    while (getline(lines, line)) {
+        if (line == "Doors here lead:")
+            list = &r.doors;
+        else if (line == "Items here:")
+            list = &r.items;
+        else if (line.rfind("- ", 0) == 0 && list)
+            list->push_back(line.substr(2));
         else
-            return static_cast<modes>(par_[j] - '0');
+            list = nullptr;
     }
+    return r;
+}
 
-  public:
-    memory_cell(memory &mem, param_modes const &par, mem_index base,
-                mem_index const &offset)
-        : mem_(mem), par_(par), base_(base), offset_(offset) {}
-
-    mem_index const base_;
-    mem_index const offset_;
+string opposite(string const &dir) {
+    static map<string, string> const back = {{"north", "south"},
+                                             {"south", "north"},
+                                             {"east", "west"},
+                                             {"west", "east"}};
+    return back.at(dir);
+}
 
-    mem_val &operator[](mem_index j) {
-        if (base_ + j >= mem_index(mem_.size()))
-            mem_.resize(base_ + j + 1, 0);
-        auto &val = mem_.at(base_ + j);
-        // cout << "mem at " << base_ << "+" << j << " = " << val << "\n";
-        switch (mode(j)) {
-        case position_mode:
-            if (val >= mem_index(mem_.size())) {
-                mem_.resize(val + 1); // invalidates references!
-                val = mem_.at(base_ + j);
+/**
+ * Solves the game without a player: a BFS over the rooms that forks the
+ * machine at every door, a test of every item in a fork of its room, one
+ * walk collecting the safe ones, and then the item subsets at the pressure
+ * plate in Gray-code order, so that each attempt differs from the previous
+ * one by a single take or drop. Attempts run on forks of the checkpoint.
+ */
+int explore(memory const &ops) {
+    machine start(ops);
+    auto first = parse_room(command(start, "").text);
+    if (!first)
+        return cerr << "no room at the start\n", 1;
+
+    map<string, vector<string>> path = {{first->name, {}}};
+    vector<room> rooms = {*first};
+    string checkpoint, plate_door;
+    deque<machine> frontier = {start};
+    for (size_t i = 0; !frontier.empty(); i++) {
+        auto m = move(frontier.front());
+        frontier.pop_front();
+        for (auto &door : rooms[i].doors) {
+            auto next = m.fork();
+            auto r = command(next, door);
+            if (r.text.find("Alert!") != string::npos) {
+                checkpoint = rooms[i].name, plate_door = door;
+                continue;
             }
-            return mem_.at(val);
-        case immediate_mode:
-            return val;
-        case relative_mode: {
-            auto rel = offset_ + val;
-            if (rel >= mem_index(mem_.size()))
-                mem_.resize(rel + 1);
-            return mem_.at(rel);
-        }
-        default:
-            cerr << "unknown mode " << mode(j) << " in cell " << base_ << "\n";
-            return mem_[-1];
+            auto to = parse_room(r.text);
+            if (!r.alive || !to || path.count(to->name))
+                continue;
+            path[to->name] = path[rooms[i].name];
+            path[to->name].push_back(door);
+            rooms.push_back(*to);
+            frontier.push_back(move(next));
         }
     }
-};
-
-class instruction {
-  public:
-    using func = function<mem_index(memory_cell, machine &)>;
-    instruction(func p_action) : action(move(p_action)) {}
-    auto operator()(memory_cell c, machine &m) const {
-        return action(move(c), m);
-    }
-
-  private:
-    func action;
-};
-
-/// instruction map
-const map<opcode, instruction> instr = {
-    {opcode::add, {[](auto c, auto &m) {
-         c[2] = c[0] + c[1];
-         return 4;
-     }}},
-    {opcode::mul, {[](auto c, auto &m) {
-         c[2] = c[0] * c[1];
-         return 4;
-     }}},
-    {opcode::in, {[](auto c, auto &m) {
-         if (!m.input_.empty()) {
-             //cout << "reading input " << m.input_.front() << " into " << c[0]
-             //     << "\n";
-             c[0] = m.input_.front();
-             m.input_.pop_front();
-         } else {
-             // cout << "Input a number: ";
-             // int inp;
-             // cin >> inp;
-             // c[0] = inp;
-             // cout << "Awaiting input\n";
-             m.status_ = 2;
-             return 0;
-         }
-         return 2;
-     }}},
-    {opcode::out, {[](auto c, auto &m) {
-         m.output_.push_back(c[0]);
-         return 2;
-     }}},
-    {opcode::jnz, {[](auto c, auto &m) {
-         if (c[0] != 0) {
-             auto r = static_cast<mem_index>(-c.base_ + c[1] + 1);
-             return r;
-         } else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::jz, {[](auto c, auto &m) {
-         if (c[0] == 0)
-             return static_cast<mem_index>(-c.base_ + c[1] + 1);
-         else
-             return static_cast<mem_index>(3);
-     }}},
-    {opcode::lt, {[](auto c, auto &m) {
-         c[2] = c[0] < c[1];
-         return 4;
-     }}},
-    {opcode::eq, {[](auto c, auto &m) {
-         c[2] = c[0] == c[1];
-         return 4;
-     }}},
-    {opcode::crel, {[](auto c, auto &m) {
-         m.relative_offset_ += c[0];
-         return 2;
-     }}},
-};
-
-pair<opcode, param_modes> machine::parse_mem(mem_val p) {
-    auto str = to_string(p);
-    string op = {str.back()};
-    if (str.size() > 1)
-        op = str[str.size() - 2] + op;
-    param_modes par;
-    for (auto a : nums(0, max(0, int(str.size()) - 2)))
-        par.push_back(str[a]);
-    r::reverse(par);
-    return {static_cast<opcode>(stoi(op)), par};
-}
-
-io_buffer machine::run_code(io_buffer input) {
-    input_ = move(input);
-    output_ = {};
-    while (i_mem < mem.size()) {
-        auto [op, params] = parse_mem(mem[i_mem]);
-        // cout << "instruction " << mem[i_mem] << " = " << int(op) << " with "
-        //     << params << "\n ";
-        if (op == opcode::halt) {
-            halted_ = true;
-            break;
+    if (checkpoint.empty())
+        return cerr << "no pressure-sensitive floor found\n", 1;
+
+    // an item is safe if the droid can still move after taking it
+    auto walk = [&](machine &m, vector<string> const &dirs) {
+        for (auto &d : dirs)
+            if (!command(m, d).alive)
+                return false;
+        return true;
+    };
+    vector<string> items;
+    machine walker = start;
+    for (auto &r : rooms) {
+        vector<string> safe;
+        for (auto &item : r.items) {
+            auto m = walker.fork();
+            walk(m, path[r.name]);
+            auto took = command(m, "take " + item);
+            if (took.alive && command(m, r.doors[0]).alive &&
+                parse_room(command(m, opposite(r.doors[0])).text))
+                safe.push_back(item);
         }
-        if (auto a = instr.find(op); a != instr.end())
-            i_mem += a->second(
-                memory_cell(mem, params, i_mem + 1, relative_offset_), *this);
-        else {
-            cerr << i_mem << ": unknown opcode " << int(op) << "\n";
-            break;
+        if (safe.empty())
+            continue;
+        walk(walker, path[r.name]);
+        for (auto &item : safe)
+            command(walker, "take " + item), items.push_back(item);
+        auto back = path[r.name];
+        reverse(back.begin(), back.end());
+        for (auto &d : back)
+            d = opposite(d);
+        walk(walker, back);
+    }
+    walk(walker, path[checkpoint]);
+    cout << "explored " << rooms.size() << " rooms, took";
+    for (auto &item : items)
+        cout << (&item == &items[0] ? " " : ", ") << item;
+    cout << "\n";
+
+    // walker holds everything; gray code step k toggles item ctz(k)
+    for (size_t k = 0; k < (1_s << items.size()); k++) {
+        if (k > 0) {
+            auto bit = size_t(__builtin_ctzll(k));
+            auto held = ((k ^ (k >> 1)) >> bit & 1) == 0;
+            command(walker, (held ? "take " : "drop ") + items[bit]);
         }
-        if (status_ != 0) {
-            status_ = 0;
-            break;
+        auto attempt = walker.fork();
+        auto r = command(attempt, plate_door);
+        if (r.text.find("Alert!") == string::npos) {
+            cout << r.text.substr(r.text.rfind("== ")) << "\n";
+            return 0;
         }
     }
-    return move(output_);
-}
-
-struct coord {
-    int x, y;
-    bool operator<(coord const &p) const {
-        return x < p.x || (x == p.x && y < p.y);
-    }
-    bool operator==(coord const &p) const { return x == p.x && y == p.y; }
-};
-ostream &operator<<(ostream &o, coord const &p) {
-    o << p.x << "," << p.y;
-    return o;
+    cerr << "no combination of items works\n";
+    return 1;
 }
 
+/// Usage: day25 <program> [auto]; without auto you play yourself
 int main(int argc, char **argv) {
     if (argc < 2)
         return 99;
-    ifstream in(argv[1]);
-    memory ops;
-    for (mem_val a = 0; in >> a;) {
-        ops.push_back(a);
-        in.ignore();
-    }
+    auto ops = load_program(argv[1]);
+    if (argc > 2 && argv[2] == string("auto"))
+        return explore(ops);
 
     machine m(ops);
     io_buffer input;
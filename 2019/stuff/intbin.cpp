@@ -0,0 +1,12 @@
+#include "../_main.hpp"
+#include "../_intcode.hpp"
+
+/// Converts a program to the binary image format (see write_intbin).
+/// Usage: intbin <program> <image.intbin>
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Usage: intbin <program> <image.intbin>\n";
+        return 99;
+    }
+    write_intbin(argv[2], load_program(argv[1]));
+}
@@ -0,0 +1,235 @@
+#include "../_main.hpp"
+#include "../_intcode.hpp"
+
+/// Number of parameters of an opcode, -1 for opcodes we cannot compile
+int n_params(opcode op) {
+    switch (op) {
+    case opcode::add:
+    case opcode::mul:
+    case opcode::lt:
+    case opcode::eq:
+        return 3;
+    case opcode::jnz:
+    case opcode::jz:
+        return 2;
+    case opcode::in:
+    case opcode::out:
+    case opcode::crel:
+        return 1;
+    case opcode::halt:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/// Addresses the program writes to with a constant (position mode)
+/// destination. Parameter words among them are read at run time instead of
+/// being compiled in; instructions whose opcode word is among them are left
+/// to the interpreter.
+set<mem_index> volatile_words;
+
+/// C++ expression for the raw parameter j of the instruction at pc
+string raw(memory const &ops, mem_index pc, int j) {
+    auto i = pc + 1 + j;
+    if (volatile_words.count(i))
+        return "m.read(" + to_string(i) + ")";
+    return to_string(ops[i]);
+}
+
+/// C++ expression for the value of parameter j of the instruction at pc
+string value(memory const &ops, mem_index pc, decoded_instr const &d, int j) {
+    auto p = raw(ops, pc, j);
+    switch (d.modes[j]) {
+    case param_mode::position:
+        return "m.read(" + p + ")";
+    case param_mode::immediate:
+        return "mem_val(" + p + ")";
+    default:
+        return "m.read(m.relative_offset_ + " + p + ")";
+    }
+}
+
+/// C++ expression for the address parameter j of the instruction at pc
+/// refers to (immediate destinations are rejected while collecting labels)
+string address(memory const &ops, mem_index pc, decoded_instr const &d,
+               int j) {
+    auto p = raw(ops, pc, j);
+    if (d.modes[j] == param_mode::relative)
+        return "m.relative_offset_ + " + p;
+    return "mem_index(" + p + ")";
+}
+
+/// Collects the instructions reachable from address 0, following
+/// fall-through edges (also behind unconditional jumps, where calls return to)
+/// and jumps with immediate targets.
+map<mem_index, decoded_instr> find_instructions(memory const &ops) {
+    map<mem_index, decoded_instr> instrs;
+    deque<mem_index> todo = {0};
+    auto size = mem_index(ops.size());
+    while (!todo.empty()) {
+        auto pc = todo.front();
+        todo.pop_front();
+        if (pc < 0 || pc >= size || instrs.count(pc) ||
+            volatile_words.count(pc))
+            continue;
+        auto d = decode_word(ops[pc]);
+        auto n = n_params(d.op);
+        if (n < 0 || pc + n >= size)
+            continue;
+        auto valid = true;
+        for (auto j : nums(0, n))
+            valid &= int(d.modes[j]) <= 2;
+        if ((n == 3 && d.modes[2] == param_mode::immediate) ||
+            (d.op == opcode::in && d.modes[0] == param_mode::immediate))
+            valid = false;
+        if (!valid)
+            continue;
+        instrs[pc] = d;
+        if (d.op == opcode::halt)
+            continue;
+        if ((d.op == opcode::jnz || d.op == opcode::jz) &&
+            d.modes[1] == param_mode::immediate &&
+            !volatile_words.count(pc + 2))
+            todo.push_back(mem_index(ops[pc + 2]));
+        todo.push_back(pc + 1 + n);
+    }
+    return instrs;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Usage: intcode_aot <program> <output.cpp>\n";
+        return 99;
+    }
+    ofstream out(argv[2]);
+    auto ops = load_program(argv[1]);
+    // writes can hide instructions and vice versa, so iterate to a fixpoint
+    auto instrs = find_instructions(ops);
+    for (auto changed = true; changed;) {
+        auto n_volatile = volatile_words.size();
+        for (auto &[pc, d] : instrs) {
+            auto n = n_params(d.op);
+            if ((n == 3 || d.op == opcode::in) &&
+                d.modes[n - 1] == param_mode::position &&
+                !volatile_words.count(pc + n))
+                volatile_words.insert(mem_index(ops[pc + n]));
+        }
+        changed = volatile_words.size() != n_volatile;
+        if (changed)
+            instrs = find_instructions(ops);
+    }
+    auto label = [&](mem_index pc) { return "L" + to_string(pc); };
+    // continue at pc: a direct jump if it is compiled, else the interpreter
+    auto go = [&](mem_index pc) {
+        if (instrs.count(pc))
+            return "goto " + label(pc) + ";";
+        return "{ m.i_mem = " + to_string(pc) + "; return m.fall_back(); }";
+    };
+
+    out << "// Generated by stuff/intcode_aot from " << argv[1]
+        << ", do not edit.\n"
+        << "#include \"_main.hpp\"\n"
+        << "#include \"_intcode.hpp\"\n"
+        << "#include \"_intcode_aot.hpp\"\n\n";
+    out << "memory const PROGRAM = {";
+    for (auto i : nums(0_s, ops.size()))
+        out << (i % 16 == 0 ? "\n    " : " ") << ops[i] << ",";
+    out << "\n};\n\n";
+    out << "vector<mem_index> const CODE_WORDS = {";
+    auto n_words = 0;
+    for (auto &[pc, d] : instrs)
+        for (auto i : nums(pc, pc + 1 + n_params(d.op)))
+            if (!volatile_words.count(i))
+                out << (n_words++ % 16 == 0 ? "\n    " : " ") << i << ",";
+    out << "\n};\n\n";
+
+    out << "void run_compiled(aot_machine &m) {\n"
+        << "    goto dispatch;\n";
+    for (auto i = instrs.begin(); i != instrs.end(); ++i) {
+        auto &[pc, d] = *i;
+        auto after = pc + 1 + n_params(d.op);
+        auto v = [&, pc = pc, &d = d](int j) { return value(ops, pc, d, j); };
+        auto dst = [&, pc = pc, &d = d](int j) {
+            return address(ops, pc, d, j);
+        };
+        auto store = [&](int j, string const &val) {
+            return "if (m.store(" + dst(j) + ", " + val + ")) { m.i_mem = " +
+                   to_string(after) + "; return m.fall_back(); }";
+        };
+        out << label(pc) << ":\n    ";
+        switch (d.op) {
+        case opcode::add:
+            out << store(2, v(0) + " + " + v(1));
+            break;
+        case opcode::mul:
+            out << store(2, v(0) + " * " + v(1));
+            break;
+        case opcode::lt:
+            out << store(2, "mem_val(" + v(0) + " < " + v(1) + ")");
+            break;
+        case opcode::eq:
+            out << store(2, "mem_val(" + v(0) + " == " + v(1) + ")");
+            break;
+        case opcode::in:
+            out << "if (m.input_.empty()) { m.i_mem = " << pc
+                << "; return; }\n    "
+                << "{ auto a = m.input_.front(); m.input_.pop_front(); "
+                << store(0, "a") << " }";
+            break;
+        case opcode::out:
+            out << "if (m.output_.full()) { m.i_mem = " << pc
+                << "; return; }\n    "
+                << "m.output_.push_back(" << v(0) << ");";
+            break;
+        case opcode::crel:
+            out << "m.relative_offset_ += mem_index(" << v(0) << ");";
+            break;
+        case opcode::jnz:
+        case opcode::jz: {
+            auto cond = v(0) + (d.op == opcode::jnz ? " != 0" : " == 0");
+            if (d.modes[1] == param_mode::immediate &&
+                !volatile_words.count(pc + 2))
+                out << "if (" << cond << ") " << go(mem_index(ops[pc + 2]));
+            else
+                out << "if (" << cond << ") { m.i_mem = mem_index(" << v(1)
+                    << "); goto dispatch; }";
+            break;
+        }
+        case opcode::halt:
+            out << "m.i_mem = " << pc << ";\n    m.halted_ = true;\n"
+                << "    return;\n";
+            continue;
+        default:
+            break;
+        }
+        out << "\n";
+        auto following = next(i);
+        if (following == instrs.end() || following->first != after)
+            out << "    " << go(after) << "\n";
+    }
+    out << "dispatch:\n"
+        << "    switch (m.i_mem) {\n";
+    for (auto &[pc, d] : instrs)
+        out << "    case " << pc << ": goto " << label(pc) << ";\n";
+    out << "    }\n"
+        << "    m.fall_back();\n"
+        << "}\n\n";
+
+    out << "#ifndef AOT_NO_MAIN\n"
+        << "int main() {\n"
+        << "    aot_machine m(PROGRAM, PROGRAM, CODE_WORDS, run_compiled);\n"
+        << "    io_buffer input;\n"
+        << "    while (true) {\n"
+        << "        for (auto a : m.run_code(move(input)))\n"
+        << "            cout << a << \"\\n\";\n"
+        << "        if (m.halted_)\n"
+        << "            break;\n"
+        << "        mem_val inp;\n"
+        << "        if (!(cin >> inp))\n"
+        << "            break;\n"
+        << "        input = {inp};\n"
+        << "    }\n"
+        << "}\n"
+        << "#endif\n";
+}
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 using namespace std;
@@ -32,68 +35,232 @@ map<string, opcode> opcode_names = {
     {"halt", opcode::halt},
 };
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        cerr << "Usage: asm <input> <output>";
-        return 99;
+struct operand {
+    char mode; /// '0' position, '1' immediate, '2' relative
+    mem_val value = 0;
+    string label; /// if set, value is the address of this label
+    bool constant() const { return mode == '1' && label.empty(); }
+    bool operator==(operand const &p) const {
+        return mode == p.mode && value == p.value && label == p.label;
     }
-    auto i_line = 1, i_tok = 0;
-    ifstream in(argv[1]);
-    ofstream out(argv[2]);
-    map<string, int> labels;
+};
+
+struct instruction {
+    opcode op;
+    vector<operand> params;
+    vector<string> labels; /// labels defined at this instruction
+    int line;
+};
+
+/// Parses one line (labels, then the instruction, then '#' comments) into
+/// in, or returns an error message. Lines without an instruction leave
+/// in.line at 0.
+string parse(string const &text, int i_line, instruction &in) {
+    istringstream tokens(text.substr(0, text.find('#')));
     string s;
-    while (in >> s) {
-        if (s.back() == ':') {
-            labels[s.substr(0, s.size() - 1)] = i_tok;
-            // cout << "label " << s.substr(0, s.size() - 1) << " at " << i_tok
-            //     << "\n";
-            in >> s;
-        }
-        auto op_name = s;
-        i_tok++;
-        if (opcode_names.find(op_name) == opcode_names.end())
-            return cerr << "invalid opcode '" << op_name << "' in line "
-                        << i_line << "\n",
-                   99;
-        auto op_number = static_cast<int>(opcode_names.at(op_name));
-        auto modes = param_modes();
-        auto params = vector<mem_val>();
-        while (in >> s) {
-            auto colon = s.find(':');
-            auto spec = s.substr(0, colon);
-            if (colon == string::npos)
-                modes.push_back('1');
-            else if (spec == SPECIFIER_POSITION_MODE)
-                modes.push_back('0');
-            else if (spec == SPECIFIER_RELATIVE_MODE)
-                modes.push_back('2');
-            else
-                return cerr << "invalid mode specifier '" << spec
-                            << "' in line " << i_line << "\n",
-                       99;
+    while (tokens >> s && s.back() == ':')
+        in.labels.push_back(s.substr(0, s.size() - 1));
+    if (!tokens)
+        return "";
+    if (opcode_names.find(s) == opcode_names.end())
+        return "invalid opcode '" + s + "'";
+    in.op = opcode_names.at(s);
+    in.line = i_line;
+    while (tokens >> s) {
+        auto colon = s.find(':');
+        auto spec = s.substr(0, colon);
+        operand p;
+        if (colon == string::npos)
+            p.mode = '1';
+        else if (spec == SPECIFIER_POSITION_MODE)
+            p.mode = '0';
+        else if (spec == SPECIFIER_RELATIVE_MODE)
+            p.mode = '2';
+        else
+            return "invalid mode specifier '" + spec + "'";
 
-            auto val = colon == string::npos ? s : s.substr(colon + 1);
-            if (val.front() == '*') {
-                if (labels.find(val.substr(1)) == labels.end())
-                    return cerr << "unknown label '" << val.substr(1)
-                                << "' in line " << i_line << "\n",
-                           99;
-                val = to_string(labels.at(val.substr(1)));
-            }
+        auto val = colon == string::npos ? s : s.substr(colon + 1);
+        if (val.front() == '*')
+            p.label = val.substr(1);
+        else
             try {
-                params.push_back(stoll(val));
+                p.value = stoll(val);
             } catch (...) {
-                cerr << "invalid parameter value '" << val << "' in line "
-                     << i_line << "\n(did you mean: '*" << val << "'?)\n";
-                return 99;
+                return "invalid parameter value '" + val +
+                       "'\n(did you mean: '*" + val + "'?)";
             }
-            i_tok++;
-            if (in.peek() == '\n') {
-                in.ignore();
-                break;
+        in.params.push_back(p);
+    }
+    return "";
+}
+
+bool is_jump(instruction const &in) {
+    return (in.op == opcode::jnz || in.op == opcode::jz) &&
+           in.params.size() == 2;
+}
+/// A jump whose condition is a constant that makes it always jump
+bool always_jumps(instruction const &in) {
+    return is_jump(in) && in.params[0].constant() &&
+           (in.params[0].value != 0) == (in.op == opcode::jnz);
+}
+
+/**
+ * Peephole optimizations for -O, repeated until nothing changes:
+ *  - arithmetic and comparisons on two constants become a constant store
+ *  - stores of a cell to itself (add 0 / mul 1) are dropped
+ *  - jumps on a constant become unconditional jumps or are dropped, as are
+ *    jumps to the next instruction
+ *  - code after an unconditional jump or halt is dropped up to the next
+ *    label that is referenced anywhere
+ * Numeric addresses are assumed not to point into the code, since the code
+ * moves; labels are resolved after optimizing and stay correct.
+ */
+void optimize(vector<instruction> &prog, vector<string> &end_labels) {
+    for (auto changed = true; changed;) {
+        changed = false;
+        set<string> referenced;
+        for (auto &in : prog)
+            for (auto &p : in.params)
+                if (!p.label.empty())
+                    referenced.insert(p.label);
+        auto is_referenced = [&](instruction const &in) {
+            for (auto &l : in.labels)
+                if (referenced.count(l))
+                    return true;
+            return false;
+        };
+
+        vector<bool> dead(prog.size());
+        auto reachable = true;
+        for (size_t i = 0; i < prog.size(); i++) {
+            auto &in = prog[i];
+            auto &p = in.params;
+            reachable |= is_referenced(in);
+            if (!reachable) {
+                dead[i] = true;
+                continue;
+            }
+            auto arith = in.op == opcode::add || in.op == opcode::mul ||
+                         in.op == opcode::lt || in.op == opcode::eq;
+            if (arith && p.size() == 3 && p[0].constant() &&
+                p[1].constant() &&
+                !(in.op == opcode::add && p[1].value == 0)) {
+                auto a = p[0].value, b = p[1].value;
+                auto v = in.op == opcode::add   ? a + b
+                         : in.op == opcode::mul ? a * b
+                         : in.op == opcode::lt  ? mem_val(a < b)
+                                                : mem_val(a == b);
+                in.op = opcode::add, p[0].value = v, p[1].value = 0;
+                changed = true;
             }
+            if (arith && p.size() == 3 && p[1].constant() &&
+                p[0] == p[2] && p[0].mode != '1' &&
+                ((in.op == opcode::add && p[1].value == 0) ||
+                 (in.op == opcode::mul && p[1].value == 1)))
+                dead[i] = true;
+            if (is_jump(in) && p[0].constant() && !always_jumps(in))
+                dead[i] = true;
+            if (always_jumps(in)) {
+                if (!(in.op == opcode::jz && p[0].value == 0))
+                    in.op = opcode::jz, p[0].value = 0, changed = true;
+                if (!p[1].label.empty() && i + 1 < prog.size()) {
+                    auto &ls = prog[i + 1].labels;
+                    if (find(ls.begin(), ls.end(), p[1].label) != ls.end())
+                        dead[i] = true;
+                }
+            }
+            reachable = !(in.op == opcode::halt || always_jumps(in)) ||
+                        dead[i];
+        }
+
+        // drop dead instructions, handing their labels to the next one
+        vector<instruction> kept;
+        vector<string> labels;
+        for (size_t i = 0; i < prog.size(); i++) {
+            labels.insert(labels.end(), prog[i].labels.begin(),
+                          prog[i].labels.end());
+            if (dead[i]) {
+                changed = true;
+                continue;
+            }
+            prog[i].labels = move(labels);
+            labels.clear();
+            kept.push_back(move(prog[i]));
+        }
+        end_labels.insert(end_labels.end(), labels.begin(), labels.end());
+        prog = move(kept);
+    }
+}
+
+int main(int argc, char **argv) {
+    auto optimizing = argc >= 2 && argv[1] == string("-O");
+    if (argc < 3 + optimizing) {
+        cerr << "Usage: asm [-O] <input> <output>";
+        return 99;
+    }
+    ifstream in(argv[1 + optimizing]);
+    ofstream out(argv[2 + optimizing]);
+
+    // first pass: parse everything
+    vector<instruction> prog;
+    vector<string> pending; // labels on lines of their own
+    string text;
+    for (auto i_line = 1; getline(in, text); i_line++) {
+        instruction instr = {};
+        if (auto error = parse(text, i_line, instr); !error.empty())
+            return cerr << error << " in line " << i_line << "\n", 99;
+        auto &ls = instr.labels;
+        if (instr.line == 0) {
+            pending.insert(pending.end(), ls.begin(), ls.end());
+            continue;
+        }
+        ls.insert(ls.begin(), pending.begin(), pending.end());
+        pending.clear();
+        prog.push_back(move(instr));
+    }
+    // labels after the last instruction point behind the code
+    auto end_labels = move(pending);
+    auto n_parsed = prog.size();
+    if (optimizing) {
+        optimize(prog, end_labels);
+        cerr << argv[2 + optimizing] << ": " << n_parsed << " -> " << prog.size()
+             << " instructions\n";
+    }
+
+    // second pass: lay out the code and resolve the labels
+    map<string, int> labels;
+    auto define = [&](string const &l, int at) {
+        return labels.insert({l, at}).second;
+    };
+    auto i_tok = 0;
+    for (auto &in : prog) {
+        for (auto &l : in.labels)
+            if (!define(l, i_tok))
+                return cerr << "duplicate label '" << l << "' in line "
+                            << in.line << "\n",
+                       99;
+        i_tok += 1 + int(in.params.size());
+    }
+    for (auto &l : end_labels)
+        if (!define(l, i_tok))
+            return cerr << "duplicate label '" << l << "'\n", 99;
+
+    auto first = true;
+    for (auto &in : prog) {
+        auto modes = param_modes();
+        auto params = vector<mem_val>();
+        for (auto &p : in.params) {
+            modes.push_back(p.mode);
+            if (p.label.empty())
+                params.push_back(p.value);
+            else if (labels.find(p.label) == labels.end())
+                return cerr << "unknown label '" << p.label << "' in line "
+                            << in.line << "\n",
+                       99;
+            else
+                params.push_back(labels.at(p.label));
         }
-        auto full_opcode = to_string(op_number);
+        auto full_opcode = to_string(static_cast<int>(in.op));
         if (full_opcode.size() == 1)
             full_opcode = '0' + full_opcode;
         for (auto a : modes)
@@ -101,12 +268,12 @@ int main(int argc, char **argv) {
         while (full_opcode.front() == '0')
             full_opcode.erase(full_opcode.begin());
 
-        if (i_line != 1)
+        if (!first)
             out << ",";
+        first = false;
         out << full_opcode;
         for (auto p : params) {
             out << "," << p;
         }
-        i_line++;
     }
 }
@@ -0,0 +1,105 @@
+#include "../_main.hpp"
+#include "../_intcode.hpp"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * One profiled run, for the instruction count and the expected output. It
+ * runs in a child process and sends both back through a pipe, so the
+ * profile's memory does not show up in the peak RSS reported for the timed
+ * runs.
+ */
+pair<uint64_t, io_buffer> counted_run(memory const &ops,
+                                      io_buffer const &input) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        cerr << "cannot create a pipe\n";
+        throw "pipe failed";
+    }
+    cout.flush(), cerr.flush();
+    auto pid = fork();
+    if (pid < 0) {
+        cerr << "fork failed\n";
+        throw "fork failed";
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        machine counted(ops);
+        counted.profile_ = make_shared<machine_profile>(false);
+        auto out = counted.run_code(input);
+        vector<mem_val> words = {mem_val(counted.profile_->instructions())};
+        words.insert(words.end(), out.begin(), out.end());
+        auto bytes = reinterpret_cast<char const *>(words.data());
+        auto left = words.size() * sizeof(mem_val);
+        for (ssize_t n; left > 0 && (n = write(fds[1], bytes, left)) > 0;)
+            bytes += n, left -= size_t(n);
+        _exit(left == 0 ? 0 : 1);
+    }
+    close(fds[1]);
+    string bytes;
+    char buf[1 << 12];
+    for (ssize_t n; (n = read(fds[0], buf, sizeof(buf))) > 0;)
+        bytes.append(buf, size_t(n));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        bytes.size() < sizeof(mem_val) || bytes.size() % sizeof(mem_val)) {
+        cerr << "the counted run failed\n";
+        throw "counted run failed";
+    }
+    vector<mem_val> words(bytes.size() / sizeof(mem_val));
+    memcpy(words.data(), bytes.data(), bytes.size());
+    return {uint64_t(words[0]), io_buffer(words.begin() + 1, words.end())};
+}
+
+/// Runs an Intcode program repeatedly and reports instructions per second,
+/// the median and p99 run time and the peak RSS of the timed runs.
+/// Usage: intcode_bench <program> [inputs...]
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Usage: intcode_bench <program> [inputs...]\n";
+        return 99;
+    }
+    auto ops = load_program(argv[1]);
+    io_buffer input;
+    for (auto a : nums(2, argc))
+        input.push_back(stoll(argv[a]));
+
+    auto [instructions, expected] = counted_run(ops, input);
+
+    auto const min_runs = 5, max_runs = 200;
+    auto const budget = chrono::seconds(2);
+    vector<chrono::nanoseconds> times;
+    auto total = chrono::nanoseconds(0);
+    while (int(times.size()) < min_runs ||
+           (int(times.size()) < max_runs && total < budget)) {
+        machine m(ops);
+        m.profile_ = nullptr;
+        auto start = chrono::steady_clock::now();
+        auto out = m.run_code(input);
+        auto took = chrono::steady_clock::now() - start;
+        if (out != expected) {
+            cerr << argv[1] << ": output differs between runs!\n";
+            return 1;
+        }
+        times.push_back(took);
+        total += took;
+    }
+    sort(times.begin(), times.end());
+    auto median = times[times.size() / 2];
+    auto p99 = times[min(times.size() - 1, times.size() * 99 / 100)];
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    string name = argv[1];
+    for (auto a : nums(2, argc))
+        name += string(" ") + argv[a];
+    cout << left << setw(28) << name << right << setw(11) << instructions
+         << " instr " << fixed << setprecision(1) << setw(8)
+         << double(instructions) * 1000 / double(median.count()) << " Minstr/s"
+         << setw(10) << median.count() / 1000 << " us median" << setw(10)
+         << p99.count() / 1000 << " us p99" << setw(8)
+         << usage.ru_maxrss / 1024 << " MB RSS\n";
+}
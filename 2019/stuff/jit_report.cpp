@@ -0,0 +1,39 @@
+#include "../_main.hpp"
+#include "../_intcode.hpp"
+
+/// Runs an Intcode program with the interpreter and with the JIT and
+/// reports the speedup. Usage: jit_report <program> [inputs...]
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Usage: jit_report <program> [inputs...]\n";
+        return 99;
+    }
+    auto ops = load_program(argv[1]);
+    io_buffer input;
+    for (auto a : nums(2, argc))
+        input.push_back(stoll(argv[a]));
+
+    auto const repeats = 20;
+    auto time = [&](dispatch_mode mode, io_buffer &out) {
+        auto best = chrono::nanoseconds::max();
+        for (auto r = 0; r < repeats; r++) {
+            machine m(ops);
+            m.dispatch_ = mode;
+            auto start = chrono::steady_clock::now();
+            out = m.run_code(input);
+            auto took = chrono::steady_clock::now() - start;
+            best = min(best, chrono::duration_cast<chrono::nanoseconds>(took));
+        }
+        return best;
+    };
+    io_buffer out_interp, out_jit;
+    auto t_interp = time(dispatch_mode::jump_table, out_interp);
+    auto t_jit = time(dispatch_mode::jit, out_jit);
+    if (out_interp != out_jit) {
+        cerr << argv[1] << ": JIT output differs from the interpreter!\n";
+        return 1;
+    }
+    cout << argv[1] << ": interpreter " << t_interp.count() / 1000 << " us, jit "
+         << t_jit.count() / 1000 << " us, speedup "
+         << double(t_interp.count()) / double(t_jit.count()) << "x\n";
+}